@@ -1,11 +1,18 @@
 #include <assert.h>
+#include <errno.h>
 #include <linux/futex.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <linux/mempolicy.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+typedef unsigned char u8;
 typedef unsigned int u32;
 typedef unsigned long long u64;
 typedef long long s64;
@@ -17,10 +24,15 @@ do {									\
 } while (0)
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define ALIGN_DOWN(x, a)	((x) & ~((a)-1))
+#define ALIGN_UP(x, a)		ALIGN_DOWN((x)+(a)-1, a)
 
 #define atomic_add(p, n)	__sync_fetch_and_add(p, n)
 #define atomic_inc(p)		__sync_fetch_and_add(p, 1)
+#define atomic_dec(p)		__sync_fetch_and_sub(p, 1)
 #define popcount64(arg)		__builtin_popcountll(arg)
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
 #define barrier()		asm volatile("": : :"memory")
 
 /* See linux kernel commit b6c7347fffa6 */
@@ -28,8 +40,17 @@ do {									\
 #define mb()			barrier()
 #define rmb()			barrier()
 #define wmb()			barrier()
+#define cpu_relax()		asm volatile("pause": : :"memory")
 #endif
 
+static inline u64 rdtsc(void)
+{
+	unsigned int low, high;
+
+	asm volatile ("rdtsc":"=a" (low), "=d"(high));
+	return low | ((u64) high) << 32;
+}
+
 
 struct entry {
 	union {
@@ -62,12 +83,15 @@ struct subqueue {
 	u64 size CL_ALIGNED;
 	u64 mask;
 	u64 max_size;
+	u64 min_size; /* 0 unless AQ_SHRINK */
+	u64 flags;
+	u64 alloc_bytes; /* mmap size, 0 if allocated with calloc */
 	u64 rcu_dequeue_count;
-	u64 rcu_free_count;
 	struct subqueue *next;
 	u64 ancestor_count; /* sum of enqueue/dequeue pairs of previous queues */
 	/* consumer-owned */
 	u64 tail CL_ALIGNED;
+	u64 low_since; /* start of low occupancy, see note_occupancy() */
 	/* producer-owned */
 	u64 head_copy CL_ALIGNED;
 	u64 tail_copy;
@@ -75,6 +99,14 @@ struct subqueue {
 	u64 enqueue_collisions CL_ALIGNED;
 	/* producer-stats */
 	u64 dequeue_collisions CL_ALIGNED;
+#ifdef AQ_PROFILE
+	/* log2 buckets of enqueue-to-dequeue latency in tsc cycles */
+	u64 latency_hgram[64] CL_ALIGNED;
+	struct {
+		u64 ctr;
+		u64 tsc;
+	} sample[64] CL_ALIGNED;
+#endif
 	/* finally - the ringbuffer */
 	struct entry q[0] CL_ALIGNED;
 };
@@ -94,7 +126,22 @@ struct atomic_queue {
 	struct subqueue *enq;
 	struct subqueue *deq;
 	struct subqueue *freeq;
+	u64 rcu_free_count;
 	struct lock_pi lock;
+	u64 flags;
+	/* statistics, protected by lock */
+	u64 grows;
+	u64 shrinks;
+	u64 grow_ns; /* total lock hold time while growing or shrinking */
+	u64 grow_max_ns;
+	/* blocking consumers, see dequeue_wait() and queue_eventfd() */
+	unsigned waiters CL_ALIGNED;
+	unsigned wakeups;
+	unsigned armed;
+	int efd;
+	/* blocking producers, see enqueue_wait() */
+	unsigned space_waiters CL_ALIGNED;
+	unsigned space_wakeups;
 };
 
 inline pid_t gettid(void)
@@ -146,46 +193,67 @@ static inline void unlock_pi(struct lock_pi *l)
 }
 
 /*
- * global_rcu is an array of rcu_counters, one for each thread.
- * Counters are initially 0.  New threads claim a counter by setting
- * it to RCU_UNLOCKED.  Exiting threads allow reuse by setting the
- * counter to RCU_UNUSED.  Critical sections protected by rcu_lock()
- * set the counter to the current global_rcu_count, until rcu_unlock()
- * sets it back to RCU_UNLOCKED.
+ * Each thread gets an rcu_reader record.  Records live on a singly linked
+ * list that only ever grows.  Exiting threads mark their record RCU_UNUSED
+ * and new threads reuse those before allocating a new one.  So the list is
+ * as long as the maximum number of concurrently live threads, not the number
+ * of threads ever created.  Records are cacheline-aligned to prevent false
+ * sharing between readers.
+ *
+ * Critical sections protected by rcu_lock() set the counter to the current
+ * global_rcu_count, until rcu_unlock() sets it back to RCU_UNLOCKED.
  */
 #define RCU_UNLOCKED	(-2ull)
 #define RCU_UNUSED	(-1ull)
-static __thread u64 *local_rcu;
-static u64 global_rcu[1<<20];
+struct rcu_reader {
+	u64 count CL_ALIGNED;
+	struct rcu_reader *next;
+};
+static __thread struct rcu_reader *local_rcu;
+static struct rcu_reader *rcu_readers;
 static u64 global_rcu_count=1;
+static pthread_key_t rcu_key;
 
-static void rcu_lock(void)
+static struct rcu_reader *rcu_register_thread(void)
 {
-	if (!local_rcu) {
-		/* register our thread */
-		for (int i=0; ; i++) {
-			assert(i<ARRAY_SIZE(global_rcu));
-			u64 old = READ_ONCE(global_rcu[i]);
-			if (old && old!=RCU_UNUSED)
-				continue;
-			int err = !cmpxchg64(&global_rcu[i], old, RCU_UNLOCKED);
-			if (err)
-				continue;
-			local_rcu = &global_rcu[i];
-			break;
-		}
+	struct rcu_reader *r;
+
+	for (r = READ_ONCE(rcu_readers); r; r = r->next) {
+		if (READ_ONCE(r->count) != RCU_UNUSED)
+			continue;
+		if (cmpxchg64(&r->count, RCU_UNUSED, RCU_UNLOCKED))
+			goto out;
 	}
+	r = aligned_alloc(64, sizeof(*r));
+	r->count = RCU_UNLOCKED;
+	do {
+		r->next = READ_ONCE(rcu_readers);
+	} while (!cmpxchg_p((void **)&rcu_readers, r->next, r));
+out:
+	/* make sure rcu_destroy() gets called on thread exit */
+	pthread_setspecific(rcu_key, r);
+	return r;
+}
 
-	assert(*local_rcu == RCU_UNLOCKED);
-	WRITE_ONCE(*local_rcu, global_rcu_count);
-	mb();
+static void rcu_lock(void)
+{
+	if (!local_rcu)
+		local_rcu = rcu_register_thread();
+
+	assert(local_rcu->count == RCU_UNLOCKED);
+	/*
+	 * Needs to be a full barrier, mb() only orders against the compiler.
+	 * Our counter must be visible before we read any RCU-protected
+	 * pointers.  xchg has an implicit lock prefix.
+	 */
+	__sync_lock_test_and_set(&local_rcu->count, READ_ONCE(global_rcu_count));
 }
 
 static void rcu_unlock(void)
 {
-	assert(*local_rcu <= global_rcu_count);
+	assert(local_rcu->count <= global_rcu_count);
 	mb();
-	WRITE_ONCE(*local_rcu, RCU_UNLOCKED);
+	WRITE_ONCE(local_rcu->count, RCU_UNLOCKED);
 }
 
 static u64 rcu_register(void)
@@ -200,20 +268,21 @@ static int rcu_safe(u64 count)
 	/* optimization - we can avoid the loop for old counts */
 	if (count <= global_rcu_safe)
 		return 1;
-	for (int i=0; i<ARRAY_SIZE(global_rcu); i++) {
-		if (global_rcu[i] <= count) {
-			if (!global_rcu[i])
-				break;
+	/* RCU_UNLOCKED and RCU_UNUSED are larger than any count */
+	for (struct rcu_reader *r = READ_ONCE(rcu_readers); r; r = r->next) {
+		if (READ_ONCE(r->count) <= count)
 			return 0;
-		}
 	}
 	global_rcu_safe = count;
 	return 1;
 }
 
-static void rcu_destroy(void *unused)
+static void rcu_destroy(void *arg)
 {
-	*local_rcu = RCU_UNUSED;
+	struct rcu_reader *r = arg;
+
+	local_rcu = NULL;
+	WRITE_ONCE(r->count, RCU_UNUSED);
 }
 
 static void rcu_init(void)
@@ -221,24 +290,104 @@ static void rcu_init(void)
 	static struct lock_pi init_lock;
 	static int is_initialized;
 
-	if (is_initialized)
+	if (READ_ONCE(is_initialized))
 		return;
 	lock_pi(&init_lock);
 	if (!is_initialized) {
-		static pthread_key_t unused;
-		pthread_key_create(&unused, rcu_destroy);
-		/* TODO */
+		pthread_key_create(&rcu_key, rcu_destroy);
+		mb();
+		WRITE_ONCE(is_initialized, 1);
 	}
 	unlock_pi(&init_lock);
 }
 
-static struct subqueue *alloc_subqueue(u64 initial_size, u64 max_size)
+/*
+ * Flags for alloc_queue_flags()
+ *
+ * AQ_SHRINK	- After a burst the queue can stay large forever.  With this flag
+ *		  we go back to a smaller subqueue after SHRINK_NS of low
+ *		  occupancy, but never below the initial size.
+ * AQ_HUGEPAGE	- Back subqueues with 2MiB pages to avoid TLB misses.  Tries
+ *		  MAP_HUGETLB first, falls back to transparent hugepages.
+ *		  Every subqueue takes at least 2MiB, so only use this for
+ *		  large queues.
+ * AQ_PREFAULT	- Fault in all pages when allocating a subqueue.  Subqueues
+ *		  get allocated with the lock held, but one big populate is
+ *		  much cheaper than thousands of page faults on the hot path.
+ * AQ_NODE(n)	- Prefer memory from NUMA node n, typically the consumers'.
+ * AQ_BOUNDED	- Fixed capacity of initial_size, the queue never grows.
+ *		  enqueue() on a full queue waits for space, use
+ *		  try_enqueue() or enqueue_wait() to bound that.  Since
+ *		  the subqueue never changes, neither side needs RCU or
+ *		  the lock.
+ */
+#define AQ_SHRINK	(1<<0)
+#define AQ_HUGEPAGE	(1<<1)
+#define AQ_PREFAULT	(1<<2)
+#define AQ_BOUNDED	(1<<3)
+#define AQ_NODE_SHIFT	32
+#define AQ_NODE(n)	((u64)((n)+1) << AQ_NODE_SHIFT)
+#define AQ_MMAP		(AQ_HUGEPAGE|AQ_PREFAULT|~0ull<<AQ_NODE_SHIFT)
+
+#define PAGE_SIZE	(   0x1000)	/*  4kiB */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+#define HUGEPAGE_SIZE	( 0x200000)	/*  2MiB */
+
+static void *alloc_thp(u64 bytes)
+{
+	/* THP needs 2MiB alignment, mmap only gives us 4kiB */
+	void *p = mmap(NULL, bytes + HUGEPAGE_SIZE, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(p != MAP_FAILED);
+	void *aligned = (void *)ALIGN_UP((unsigned long)p, HUGEPAGE_SIZE);
+	if (aligned > p)
+		munmap(p, aligned - p);
+	munmap(aligned + bytes, p + HUGEPAGE_SIZE - aligned);
+	madvise(aligned, bytes, MADV_HUGEPAGE);
+	return aligned;
+}
+
+/* zeroed memory, like calloc */
+static void *alloc_pages(u64 bytes, u64 flags, u64 *alloc_bytes)
+{
+	void *p = MAP_FAILED;
+
+	if (flags & AQ_HUGEPAGE) {
+		bytes = ALIGN_UP(bytes, HUGEPAGE_SIZE);
+		p = mmap(NULL, bytes, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED)
+			p = alloc_thp(bytes);
+	} else {
+		bytes = ALIGN_UP(bytes, PAGE_SIZE);
+		p = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		assert(p != MAP_FAILED);
+	}
+	if (flags >> AQ_NODE_SHIFT) {
+		u64 node = (flags >> AQ_NODE_SHIFT) - 1;
+		assert(node < 64);
+		u64 nodemask = 1ull << node;
+		/* Errors are fine, e.g. on machines without NUMA */
+		syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, &nodemask, 8*sizeof(nodemask)+1, 0);
+	}
+	/* after mbind(), so pages come from the right node */
+	if (flags & AQ_PREFAULT && madvise(p, bytes, MADV_POPULATE_WRITE)) {
+		/* kernels before 5.14 */
+		for (u64 i=0; i<bytes; i+=PAGE_SIZE)
+			WRITE_ONCE(((u8 *)p)[i], 0);
+	}
+	*alloc_bytes = bytes;
+	return p;
+}
+
+static struct subqueue *alloc_subqueue(u64 initial_size, u64 max_size, u64 min_size, u64 flags)
 {
 	struct subqueue *subq = NULL;
+	u64 alloc_bytes = 0;
 
 	rcu_init();
-	if (!initial_size)
-		initial_size = 32;
 	if (!max_size)
 		max_size = 1ull<<59;
 	/* Lots of sanity checks */
@@ -249,24 +398,167 @@ static struct subqueue *alloc_subqueue(u64 initial_size, u64 max_size)
 	assert((u64)&subq->q[initial_size] == q_size);
 	assert((u64)&subq->q[max_size] == max_q_size);
 
-	subq = calloc(q_size, 1);
+	if (flags & AQ_MMAP)
+		subq = alloc_pages(q_size, flags, &alloc_bytes);
+	else
+		subq = calloc(q_size, 1);
 	subq->size = initial_size;
 	subq->mask = initial_size-1;
 	subq->max_size = max_size;
+	subq->min_size = min_size;
+	subq->flags = flags;
+	subq->alloc_bytes = alloc_bytes;
 	return subq;
 }
 
-struct atomic_queue *alloc_queue(u64 initial_size, u64 max_size)
+static void free_subqueue(struct subqueue *subq)
+{
+	if (subq && subq->alloc_bytes)
+		munmap(subq, subq->alloc_bytes);
+	else
+		free(subq);
+}
+
+struct atomic_queue *alloc_queue_flags(u64 initial_size, u64 max_size, u64 flags)
 {
-	//rcu_init();
-	struct subqueue *subq = alloc_subqueue(initial_size, max_size);
+	if (!initial_size)
+		initial_size = 32;
+	if (flags & AQ_BOUNDED) {
+		assert(!(flags & AQ_SHRINK));
+		max_size = initial_size;
+	}
+	u64 min_size = flags & AQ_SHRINK ? initial_size : 0;
+	struct subqueue *subq = alloc_subqueue(initial_size, max_size, min_size, flags);
 
-	struct atomic_queue *aq = malloc(sizeof(*aq));
+	struct atomic_queue *aq = aligned_alloc(64, sizeof(*aq));
+	memset(aq, 0, sizeof(*aq));
 	aq->enq = subq;
 	aq->deq = subq;
+	aq->flags = flags;
+	aq->efd = -1;
 	return aq;
 }
 
+struct atomic_queue *alloc_queue(u64 initial_size, u64 max_size)
+{
+	return alloc_queue_flags(initial_size, max_size, 0);
+}
+
+/*
+ * Destructor.  Caller has to guarantee that no other thread is still using
+ * the queue, we don't wait for RCU.  Remaining entries are silently dropped.
+ */
+void free_queue(struct atomic_queue *q)
+{
+	struct subqueue *subq = q->deq;
+
+	free_subqueue(q->freeq);
+	while (subq) {
+		struct subqueue *next = subq->next;
+		free_subqueue(subq);
+		subq = next;
+	}
+	if (q->efd >= 0)
+		close(q->efd);
+	free(q);
+}
+
+static u64 get_monotonic(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Switch producers over to a new subqueue of the given size.  Consumers will
+ * follow once rcu_dequeue_count is safe, see dequeue().
+ * Must be called with q->lock held.
+ */
+static void switch_subqueue(struct atomic_queue *q, struct subqueue *subq, u64 size)
+{
+	u64 t = get_monotonic();
+
+	subq->next = alloc_subqueue(size, subq->max_size, subq->min_size, subq->flags);
+	q->enq = subq->next;
+	mb();
+	WRITE_ONCE(subq->rcu_dequeue_count, rcu_register());
+
+	if (size > subq->size)
+		q->grows++;
+	else
+		q->shrinks++;
+	t = get_monotonic() - t;
+	q->grow_ns += t;
+	if (t > q->grow_max_ns)
+		q->grow_max_ns = t;
+}
+
+/*
+ * Shrinking policy.  Occupancy is sampled once per lap through the ring and
+ * whenever a consumer finds the queue empty.  Anything below 1/8 counts as
+ * low.  After SHRINK_NS of nothing but low samples, we switch to a subqueue of
+ * half the size.  Repeat until we hit min_size or occupancy goes up again.
+ * Since growing needs the subqueue to be completely full, the two thresholds
+ * are far enough apart to avoid oscillation.
+ */
+#define SHRINK_NS	1000000000ull	/* 1s */
+static void note_occupancy(struct subqueue *q, s64 depth)
+{
+	if (depth >= (s64)(q->size/8)) {
+		if (READ_ONCE(q->low_since))
+			WRITE_ONCE(q->low_since, 0);
+	} else if (!READ_ONCE(q->low_since)) {
+		WRITE_ONCE(q->low_since, get_monotonic());
+	}
+}
+
+static void maybe_shrink(struct atomic_queue *q, struct subqueue *subq)
+{
+	u64 low_since = READ_ONCE(subq->low_since);
+	if (!low_since) {
+		note_occupancy(subq, 0);
+		return;
+	}
+	if (get_monotonic() - low_since < SHRINK_NS)
+		return;
+	lock_pi(&q->lock);
+	if (!subq->next && q->enq == subq)
+		switch_subqueue(q, subq, subq->size/2);
+	unlock_pi(&q->lock);
+}
+
+#ifdef AQ_PROFILE
+/*
+ * Profile mode.  Every PROFILE_SAMPLE'th entry gets timestamped on enqueue
+ * and the latency accounted on dequeue.  Timestamps live in a small side
+ * array, so if the queue is deeper than 64 samples, some get overwritten
+ * before dequeue and are silently lost.
+ */
+#define PROFILE_SAMPLE	64
+static void profile_enqueue(struct subqueue *q, u64 ctr)
+{
+	if (ctr % PROFILE_SAMPLE)
+		return;
+	u32 i = (ctr / PROFILE_SAMPLE) % ARRAY_SIZE(q->sample);
+	WRITE_ONCE(q->sample[i].tsc, rdtsc());
+	wmb();
+	WRITE_ONCE(q->sample[i].ctr, ctr);
+}
+
+static void profile_dequeue(struct subqueue *q, u64 ctr)
+{
+	if (ctr % PROFILE_SAMPLE)
+		return;
+	u32 i = (ctr / PROFILE_SAMPLE) % ARRAY_SIZE(q->sample);
+	if (READ_ONCE(q->sample[i].ctr) != ctr)
+		return;
+	rmb();
+	u64 t = rdtsc() - READ_ONCE(q->sample[i].tsc);
+	atomic_inc(&q->latency_hgram[63 - __builtin_clzll(t|1)]);
+}
+#endif
+
 /* returns 0 on empty queue, 1 on dequeue */
 static int subdequeue(struct subqueue *q, u64 *retval)
 {
@@ -288,46 +580,86 @@ static int subdequeue(struct subqueue *q, u64 *retval)
 	assert(slot == (ctr & q->mask));
 	if (retries)
 		atomic_add(&q->dequeue_collisions, retries);
+	if (!slot && q->min_size)
+		note_occupancy(q, READ_ONCE(q->head_copy) - counter);
+#ifdef AQ_PROFILE
+	profile_dequeue(q, counter);
+#endif
 	*retval = val;
 	return 1;
 }
 
+/*
+ * Wake a producer waiting for space, if any.  Same protocol as the consumer
+ * wakeup in enqueue(), the cmpxchg on tail in subdequeue() is the barrier.
+ */
+static void wake_space_waiter(struct atomic_queue *q)
+{
+	if (READ_ONCE(q->space_waiters)) {
+		atomic_inc(&q->space_wakeups);
+		futex(&q->space_wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
 /* returns 0 on empty queue, 1 on dequeue */
 int dequeue(struct atomic_queue *q, u64 *retval)
 {
+	int ret=0;
+
+	if (q->flags & AQ_BOUNDED) {
+		ret = subdequeue(q->deq, retval);
+		if (ret)
+			wake_space_waiter(q);
+		return ret;
+	}
 	rcu_lock();
 	struct subqueue *subq = READ_ONCE(q->deq);
-	int ret=0;
 	do {
 		ret = subdequeue(subq, retval);
 		if (ret) {
 			rcu_unlock();
+			wake_space_waiter(q);
 			return ret;
 		}
-		/* Have all consumers forgotten about an old queue? */
-		if (q->freeq && rcu_safe(subq->rcu_free_count)) {
+		/*
+		 * Have all consumers forgotten about an old queue?  Unlocked
+		 * check is only a hint, rcu_free_count might belong to the
+		 * previous freeq.
+		 */
+		if (READ_ONCE(q->freeq) && rcu_safe(READ_ONCE(q->rcu_free_count))) {
 			lock_pi(&q->lock);
-			if (q->freeq) {
-				free(q->freeq);
+			if (q->freeq && rcu_safe(q->rcu_free_count)) {
+				free_subqueue(q->freeq);
 				q->freeq = NULL;
 			}
 			unlock_pi(&q->lock);
 		}
-		/* Have all producers forgotten about this queue? */
-		struct subqueue *next = subq->next;
-		if (next && !q->freeq && rcu_safe(subq->rcu_dequeue_count)) {
+		/*
+		 * Have all producers forgotten about this queue?  Producers
+		 * publish next before rcu_dequeue_count, so a zero count means
+		 * "not yet", not "safe".
+		 */
+		struct subqueue *next = READ_ONCE(subq->next);
+		u64 rcu_dequeue_count = READ_ONCE(subq->rcu_dequeue_count);
+		if (next && rcu_dequeue_count && !q->freeq && rcu_safe(rcu_dequeue_count)) {
 			lock_pi(&q->lock);
 			if (!q->freeq && q->deq==subq) {
 				q->freeq = subq;
 				q->deq = next;
-				subq->rcu_free_count = rcu_register();
+				q->rcu_free_count = rcu_register();
 				/* carry over statistics */
 				atomic_add(&next->enqueue_collisions, subq->enqueue_collisions);
 				atomic_add(&next->dequeue_collisions, subq->dequeue_collisions);
+#ifdef AQ_PROFILE
+				for (int i=0; i<ARRAY_SIZE(next->latency_hgram); i++)
+					atomic_add(&next->latency_hgram[i], subq->latency_hgram[i]);
+#endif
 				next->ancestor_count = subq->ancestor_count + subq->tail;
 			}
 			unlock_pi(&q->lock);
 		}
+		if (!next && subq->min_size && subq->size > subq->min_size)
+			maybe_shrink(q, subq);
 		subq = next;
 	} while (subq);
 	rcu_unlock();
@@ -360,9 +692,9 @@ retry:
 	return tries;
 }
 
+/* called with rcu_lock() held, unless the queue is AQ_BOUNDED */
 static int subenqueue(struct subqueue *q, u64 val)
 {
-	rcu_lock();
 	u64 head = READ_ONCE(q->head_copy);
 	u64 tail = READ_ONCE(q->tail_copy);
 	for (int i=0; i<4; i++) {
@@ -375,10 +707,8 @@ static int subenqueue(struct subqueue *q, u64 val)
 			/* queue appeared full */
 			u64 new_tail = READ_ONCE(q->tail);
 			assert(new_tail >= tail);
-			if (new_tail <= tail) {
-				rcu_unlock();
+			if (new_tail <= tail)
 				return 0;
-			}
 			tail = new_tail;
 			if (new_tail > READ_ONCE(q->tail_copy))
 				q->tail_copy = new_tail;
@@ -387,34 +717,907 @@ static int subenqueue(struct subqueue *q, u64 val)
 		if (tries>1)
 			atomic_add(&q->enqueue_collisions, tries-1);
 		q->head_copy = head; /* unconditional write, might occasionally go backwards. */
-		rcu_unlock();
+#ifdef AQ_PROFILE
+		profile_enqueue(q, head);
+#endif
 		return 1;
 	}
-	rcu_unlock();
 	return 0;
 }
 
-void enqueue(struct atomic_queue *q, u64 val)
+/*
+ * Wake a sleeping consumer, if any.  The cmpxchg16b in _enqueue() is a full
+ * barrier, so either we see the waiter or the waiter sees our entry.  Without
+ * waiters this is just a read of a mostly-clean cacheline and no syscall.
+ */
+static void wake_waiter(struct atomic_queue *q)
+{
+	if (READ_ONCE(q->waiters)) {
+		atomic_inc(&q->wakeups);
+		futex(&q->wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+	/* only the first producer after queue_drain() re-armed writes */
+	if (READ_ONCE(q->armed) && __sync_lock_test_and_set(&q->armed, 0)) {
+		u64 one = 1;
+		ssize_t ret = write(q->efd, &one, sizeof(one));
+		assert(ret == sizeof(one));
+	}
+}
+
+/*
+ * Returns 0 if the queue is full and cannot grow, either because it is
+ * AQ_BOUNDED or because it already reached max_size.  Returns 1 on enqueue.
+ * With concurrent consumers, "full" is only a snapshot.
+ */
+int try_enqueue(struct atomic_queue *q, u64 val)
 {
+	if (q->flags & AQ_BOUNDED) {
+		if (!subenqueue(q->enq, val))
+			return 0;
+		wake_waiter(q);
+		return 1;
+	}
 retry:;
+	/* subq must not get freed until we are done looking at it */
+	rcu_lock();
 	struct subqueue *subq = READ_ONCE(q->enq);
-	int queue_full = !subenqueue(subq, val);
-	if (queue_full) {
-		/* handle full queue - this is where things get interesting. */
+	if (subenqueue(subq, val)) {
+		rcu_unlock();
+		wake_waiter(q);
+		return 1;
+	}
+	/* handle full queue - this is where things get interesting. */
+	if (!READ_ONCE(subq->next)) {
+		/* a shrink can leave us below max_size, only a switch helps */
+		if (subq->size >= subq->max_size) {
+			rcu_unlock();
+			return 0;
+		}
 		lock_pi(&q->lock);
-		if (subq->next) {
-			/* another thread has already created a bigger queue */
-			assert(subq != READ_ONCE(q->enq));
-		} else {
+		/* another thread may have created a bigger queue meanwhile */
+		if (!subq->next) {
 			u64 size = 2 * subq->size;
 			assert(size > subq->size);
 			assert(size <= subq->max_size);
-			subq->next = alloc_subqueue(size, subq->max_size);
-			q->enq = subq->next;
-			mb();
-			subq->rcu_dequeue_count = rcu_register();
+			switch_subqueue(q, subq, size);
 		}
 		unlock_pi(&q->lock);
-		goto retry;
 	}
+	rcu_unlock();
+	goto retry;
+}
+
+/*
+ * Statistics.  Everything is sampled without stopping producers or
+ * consumers, so the numbers are only approximately consistent with each
+ * other.  Collision counts are the number of retries due to cmpxchg
+ * failures, divide by enqueues/dequeues to get a rate.
+ */
+struct queue_stats {
+	u64 depth;
+	u64 size;
+	u64 enqueues;
+	u64 dequeues;
+	u64 enqueue_collisions;
+	u64 dequeue_collisions;
+	u64 grows;
+	u64 shrinks;
+	u64 grow_ns;
+	u64 grow_max_ns;
+#ifdef AQ_PROFILE
+	u64 latency_hgram[64]; /* log2 buckets of tsc cycles */
+#endif
+};
+
+/* head_copy is just a hint, find the true head */
+static u64 true_head(struct subqueue *q)
+{
+	u64 head = READ_ONCE(q->head_copy);
+	for (u64 i=0; i<q->size; i++) {
+		if (READ_ONCE(q->q[(head+1) & q->mask].ctr) != head+1)
+			break;
+		head++;
+	}
+	return head;
+}
+
+void queue_stats(struct atomic_queue *q, struct queue_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	rcu_lock();
+	struct subqueue *subq = READ_ONCE(q->deq);
+	stats->enqueues = stats->dequeues = subq->ancestor_count;
+	for (; subq; subq = READ_ONCE(subq->next)) {
+		stats->size = subq->size;
+		stats->enqueues += true_head(subq);
+		stats->dequeues += READ_ONCE(subq->tail);
+		stats->enqueue_collisions += READ_ONCE(subq->enqueue_collisions);
+		stats->dequeue_collisions += READ_ONCE(subq->dequeue_collisions);
+#ifdef AQ_PROFILE
+		for (int i=0; i<ARRAY_SIZE(stats->latency_hgram); i++)
+			stats->latency_hgram[i] += READ_ONCE(subq->latency_hgram[i]);
+#endif
+	}
+	rcu_unlock();
+	/* racing with producers can make this appear negative */
+	if (stats->enqueues > stats->dequeues)
+		stats->depth = stats->enqueues - stats->dequeues;
+	stats->grows = READ_ONCE(q->grows);
+	stats->shrinks = READ_ONCE(q->shrinks);
+	stats->grow_ns = READ_ONCE(q->grow_ns);
+	stats->grow_max_ns = READ_ONCE(q->grow_max_ns);
+}
+
+static void deadline_after(struct timespec *ts, u64 timeout)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	timeout += ts->tv_nsec;
+	ts->tv_sec += timeout / 1000000000;
+	ts->tv_nsec = timeout % 1000000000;
+}
+
+/*
+ * Shrinking and freeing old subqueues only happen in dequeue().  Consumers
+ * sleeping in dequeue_wait() don't call it, so as long as some of that work
+ * is left they wake up every SHRINK_TICK_NS to do it.  Once the queue is
+ * back to min_size they sleep until an entry shows up.
+ */
+#define SHRINK_TICK_NS	(SHRINK_NS/4)
+static int shrink_pending(struct atomic_queue *q)
+{
+	if (!(q->flags & AQ_SHRINK))
+		return 0;
+	rcu_lock();
+	struct subqueue *subq = READ_ONCE(q->enq);
+	int ret = subq->size > subq->min_size || READ_ONCE(q->deq) != subq
+			|| READ_ONCE(q->freeq);
+	rcu_unlock();
+	return ret;
+}
+
+/*
+ * Like dequeue(), but waits up to timeout nanoseconds for an entry to show up.
+ * A timeout of -1 waits forever.  We spin for a while before going to sleep,
+ * since sleeping and getting woken up costs two syscalls and a context switch.
+ * Busy consumers should never get that far.
+ *
+ * returns 0 on timeout, 1 on dequeue
+ */
+#define DEQUEUE_SPINS	100
+int dequeue_wait(struct atomic_queue *q, u64 *retval, u64 timeout)
+{
+	struct timespec deadline;
+	u64 end = -1ull;
+
+	for (int i=0; i<DEQUEUE_SPINS; i++) {
+		if (dequeue(q, retval))
+			return 1;
+		cpu_relax();
+	}
+	if (!timeout)
+		return 0;
+	if (timeout != -1ull)
+		end = get_monotonic() + timeout;
+	for (;;) {
+		/* read wakeups before we check the queue, see enqueue() */
+		unsigned wakeups = READ_ONCE(q->wakeups);
+		int timed_out = 0;
+		atomic_inc(&q->waiters);
+		int ret = dequeue(q, retval);
+		if (!ret) {
+			u64 wake = end;
+			if (shrink_pending(q)) {
+				u64 tick = get_monotonic() + SHRINK_TICK_NS;
+				if (tick < wake)
+					wake = tick;
+			}
+			deadline.tv_sec = wake / 1000000000;
+			deadline.tv_nsec = wake % 1000000000;
+			int err = futex(&q->wakeups, FUTEX_WAIT_BITSET_PRIVATE, wakeups,
+					wake == -1ull ? NULL : &deadline,
+					NULL, FUTEX_BITSET_MATCH_ANY);
+			timed_out = err && errno == ETIMEDOUT && wake == end;
+		}
+		atomic_dec(&q->waiters);
+		if (ret)
+			return 1;
+		if (timed_out)
+			return dequeue(q, retval);
+	}
+}
+
+/*
+ * Like try_enqueue(), but waits up to timeout nanoseconds for space if the
+ * queue is full.  A timeout of -1 waits forever.  Consumers only issue a
+ * FUTEX_WAKE if someone is actually waiting, so this costs them nothing as
+ * long as the queue has space.
+ *
+ * returns 0 on timeout, 1 on enqueue
+ */
+int enqueue_wait(struct atomic_queue *q, u64 val, u64 timeout)
+{
+	struct timespec deadline;
+
+	for (int i=0; i<DEQUEUE_SPINS; i++) {
+		if (try_enqueue(q, val))
+			return 1;
+		cpu_relax();
+	}
+	if (!timeout)
+		return 0;
+	if (timeout != -1ull)
+		deadline_after(&deadline, timeout);
+	for (;;) {
+		/* read space_wakeups before we check the queue, see dequeue() */
+		unsigned wakeups = READ_ONCE(q->space_wakeups);
+		int timed_out = 0;
+		atomic_inc(&q->space_waiters);
+		int ret = try_enqueue(q, val);
+		if (!ret) {
+			int err = futex(&q->space_wakeups, FUTEX_WAIT_BITSET_PRIVATE, wakeups,
+					timeout == -1ull ? NULL : &deadline,
+					NULL, FUTEX_BITSET_MATCH_ANY);
+			timed_out = err && errno == ETIMEDOUT;
+		}
+		atomic_dec(&q->space_waiters);
+		if (ret)
+			return 1;
+		if (timed_out)
+			return try_enqueue(q, val);
+	}
+}
+
+/*
+ * Grows the queue when it is full.  Hitting max_size is a bug and crashes,
+ * same as the spsc and mpsc variants.  AQ_BOUNDED queues wait for space.
+ */
+void enqueue(struct atomic_queue *q, u64 val)
+{
+	if (q->flags & AQ_BOUNDED) {
+		enqueue_wait(q, val, -1ull);
+		return;
+	}
+	int queued = try_enqueue(q, val);
+	assert(queued);
+}
+
+/*
+ * Event loop integration.  Consumers that sit in epoll can't block in
+ * dequeue_wait().  queue_eventfd() returns an eventfd that becomes readable
+ * when entries show up in an empty queue.  Consumers call queue_drain() when
+ * it does.
+ *
+ * Producers would normally pay a syscall per enqueue for this, so writes are
+ * coalesced through q->armed.  queue_drain() sets armed once it found the
+ * queue empty, the first producer to see armed clears it and writes the
+ * eventfd.  Everyone else just reads a cacheline.  After arming, the consumer
+ * checks the queue once more to catch entries that raced with arming.
+ *
+ *	int efd = queue_eventfd(q);
+ *	epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &(struct epoll_event){ .events = EPOLLIN });
+ *	...
+ *	queue_drain(q, handle_batch, arg);
+ *
+ * There is one eventfd per queue and it is meant for a single event loop.
+ * Mixing it with other consumers works, but can cause spurious events.
+ */
+int queue_eventfd(struct atomic_queue *q)
+{
+	u64 one = 1;
+
+	assert(q->efd < 0);
+	q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(q->efd >= 0);
+	/* the queue might not be empty, let the first queue_drain() find out */
+	ssize_t ret = write(q->efd, &one, sizeof(one));
+	assert(ret == sizeof(one));
+	return q->efd;
+}
+
+/*
+ * Dequeues everything in batches of up to DRAIN_BATCH entries and calls
+ * fn(arg, vals, n) for each batch.  Re-arms the eventfd once the queue is
+ * empty.  Queues without an eventfd just get drained.  Returns the number
+ * of entries drained.
+ */
+#define DRAIN_BATCH	64
+u64 queue_drain(struct atomic_queue *q, void (*fn)(void *arg, u64 *vals, u64 n), void *arg)
+{
+	u64 vals[DRAIN_BATCH];
+	u64 count;
+	u64 total = 0;
+
+	/* clear the eventfd before looking at the queue, never after */
+	if (q->efd >= 0 && read(q->efd, &count, sizeof(count)) < 0)
+		assert(errno == EAGAIN);
+	for (;;) {
+		u64 n = 0;
+		while (n < DRAIN_BATCH && dequeue(q, &vals[n]))
+			n++;
+		if (n) {
+			fn(arg, vals, n);
+			total += n;
+			if (n == DRAIN_BATCH)
+				continue;
+		}
+		/* producers must never see armed without an eventfd */
+		if (q->efd < 0)
+			return total;
+		/*
+		 * Queue was empty, re-arm.  xchg is a full barrier, pairs
+		 * with the cmpxchg16b in _enqueue().  Either the producer
+		 * sees armed or we see its entry.
+		 */
+		__sync_lock_test_and_set(&q->armed, 1);
+		if (!dequeue(q, &vals[0]))
+			return total;
+		/* Lost the race.  Someone may have written already, that's harmless. */
+		__sync_lock_test_and_set(&q->armed, 0);
+		fn(arg, vals, 1);
+		total++;
+	}
+}
+
+/*
+ * Unordered queue.  If you don't need ordering, you can avoid having all
+ * producers and consumers fight over the same cachelines.  Each shard is a
+ * regular atomic_queue.  Every thread gets a home shard, producers only use
+ * their home shard and consumers try their home shard first before stealing
+ * from the others.
+ *
+ * A producer always uses the same shard, so its own entries stay in order.
+ * Entries from different producers have no ordering whatsoever.  If producer
+ * A enqueues before producer B, B's entry can still get dequeued first, even
+ * when A and B synchronized with each other.
+ */
+struct sharded_queue {
+	u32 nr_shards;
+	struct atomic_queue *shard[];
+};
+
+static __thread u32 local_shard_id;
+static u32 global_shard_id;
+
+static u32 home_shard(struct sharded_queue *q)
+{
+	if (!local_shard_id)
+		local_shard_id = atomic_inc(&global_shard_id) + 1;
+	return local_shard_id % q->nr_shards;
+}
+
+/* nr_shards defaults to the number of online CPUs */
+struct sharded_queue *alloc_sharded_queue(u64 initial_size, u64 max_size, u32 nr_shards)
+{
+	if (!nr_shards)
+		nr_shards = sysconf(_SC_NPROCESSORS_ONLN);
+	struct sharded_queue *q = malloc(sizeof(*q) + nr_shards*sizeof(q->shard[0]));
+	q->nr_shards = nr_shards;
+	for (u32 i=0; i<nr_shards; i++)
+		q->shard[i] = alloc_queue(initial_size, max_size);
+	return q;
+}
+
+void free_sharded_queue(struct sharded_queue *q)
+{
+	for (u32 i=0; i<q->nr_shards; i++)
+		free_queue(q->shard[i]);
+	free(q);
+}
+
+void sharded_enqueue(struct sharded_queue *q, u64 val)
+{
+	enqueue(q->shard[home_shard(q)], val);
+}
+
+/* returns 0 on empty queue, 1 on dequeue */
+int sharded_dequeue(struct sharded_queue *q, u64 *retval)
+{
+	u32 home = home_shard(q);
+	u32 i = home;
+
+	do {
+		if (dequeue(q->shard[i], retval))
+			return 1;
+		if (++i == q->nr_shards)
+			i = 0;
+	} while (i != home);
+	return 0;
+}
+
+/*
+ * Priority queue.  K regular atomic queues, level 0 being the most urgent.
+ * A bitmap word tracks which levels might be non-empty, so consumers find
+ * the most urgent work with a single load and find-first-set.  Each level
+ * preserves order, there is no ordering between levels.
+ *
+ * The bitmap is only a hint.  Producers set their bit after enqueueing.
+ * Consumers clear a bit when they find the level empty, then check the
+ * level once more.  Both sides use locked instructions, so either the
+ * consumer sees the new entry or the producer's bit survives.
+ */
+#define PRIO_MAX_LEVELS	64
+struct prio_queue {
+	u32 levels;
+	struct atomic_queue *level[PRIO_MAX_LEVELS];
+	u64 bitmap CL_ALIGNED;
+};
+
+struct prio_queue *alloc_prio_queue(u32 levels, u64 initial_size, u64 max_size)
+{
+	assert(levels && levels <= PRIO_MAX_LEVELS);
+	struct prio_queue *q = aligned_alloc(64, sizeof(*q));
+	memset(q, 0, sizeof(*q));
+	q->levels = levels;
+	for (u32 i=0; i<levels; i++)
+		q->level[i] = alloc_queue(initial_size, max_size);
+	return q;
+}
+
+void free_prio_queue(struct prio_queue *q)
+{
+	for (u32 i=0; i<q->levels; i++)
+		free_queue(q->level[i]);
+	free(q);
+}
+
+void prio_enqueue(struct prio_queue *q, u32 level, u64 val)
+{
+	assert(level < q->levels);
+	enqueue(q->level[level], val);
+	/* avoid dirtying the cacheline if the bit is already set */
+	if (!(READ_ONCE(q->bitmap) & 1ull<<level))
+		__sync_fetch_and_or(&q->bitmap, 1ull<<level);
+}
+
+/* returns 0 on empty queue, 1 on dequeue.  Most urgent level first. */
+int prio_dequeue(struct prio_queue *q, u64 *retval)
+{
+	u64 bitmap = READ_ONCE(q->bitmap);
+
+	while (bitmap) {
+		u32 level = __builtin_ctzll(bitmap);
+		struct atomic_queue *aq = q->level[level];
+		if (dequeue(aq, retval))
+			return 1;
+		__sync_fetch_and_and(&q->bitmap, ~(1ull<<level));
+		if (dequeue(aq, retval)) {
+			/* raced with a producer, there may be more */
+			__sync_fetch_and_or(&q->bitmap, 1ull<<level);
+			return 1;
+		}
+		bitmap &= ~(1ull<<level);
+	}
+	return 0;
+}
+
+/*
+ * Single-producer/single-consumer queue.  Without competition we don't need
+ * cmpxchg16b or scanning for the true head.  Head is only written by the
+ * producer, tail only by the consumer.  Each side keeps a cached copy of the
+ * opposite index and only reads the real thing when the cached copy says the
+ * ring is full or empty, so the cachelines mostly stay put.
+ *
+ * Growing works just like for the atomic queue.  The producer links a ring of
+ * twice the size and continues there.  The consumer drains the old ring
+ * before following the link.  Since the producer never looks back and there
+ * is only one consumer, we can free the old ring without RCU.
+ *
+ * Using this with more than one producer or more than one consumer will
+ * silently corrupt the queue.
+ */
+struct spsc_ring {
+	u64 size CL_ALIGNED;
+	u64 mask;
+	struct spsc_ring *next;
+	/* producer-owned */
+	u64 head CL_ALIGNED;
+	u64 tail_copy;
+	/* consumer-owned */
+	u64 tail CL_ALIGNED;
+	u64 head_copy;
+	/* finally - the ringbuffer */
+	u64 q[0] CL_ALIGNED;
+};
+
+struct spsc_queue {
+	struct spsc_ring *enq CL_ALIGNED;
+	u64 max_size;
+	struct spsc_ring *deq CL_ALIGNED;
+};
+
+static struct spsc_ring *alloc_spsc_ring(u64 size)
+{
+	struct spsc_ring *r = calloc(sizeof(*r) + size*sizeof(r->q[0]), 1);
+	r->size = size;
+	r->mask = size-1;
+	return r;
+}
+
+struct spsc_queue *alloc_spsc_queue(u64 initial_size, u64 max_size)
+{
+	if (!initial_size)
+		initial_size = 32;
+	if (!max_size)
+		max_size = 1ull<<59;
+	assert(popcount64(initial_size) == 1);
+	assert(popcount64(max_size) == 1);
+
+	struct spsc_queue *q = aligned_alloc(64, sizeof(*q));
+	memset(q, 0, sizeof(*q));
+	q->enq = q->deq = alloc_spsc_ring(initial_size);
+	q->max_size = max_size;
+	return q;
+}
+
+void free_spsc_queue(struct spsc_queue *q)
+{
+	struct spsc_ring *r = q->deq;
+
+	while (r) {
+		struct spsc_ring *next = r->next;
+		free(r);
+		r = next;
+	}
+	free(q);
+}
+
+void spsc_enqueue(struct spsc_queue *q, u64 val)
+{
+	struct spsc_ring *r = q->enq;
+	u64 head = r->head;
+
+	if (head - r->tail_copy == r->size) {
+		r->tail_copy = smp_load_acquire(&r->tail);
+		if (head - r->tail_copy == r->size) {
+			u64 size = 2 * r->size;
+			assert(size <= q->max_size);
+			struct spsc_ring *next = alloc_spsc_ring(size);
+			smp_store_release(&r->next, next);
+			q->enq = r = next;
+			head = 0;
+		}
+	}
+	r->q[head & r->mask] = val;
+	smp_store_release(&r->head, head+1);
+}
+
+/* returns 0 on empty queue, 1 on dequeue */
+int spsc_dequeue(struct spsc_queue *q, u64 *retval)
+{
+	struct spsc_ring *r;
+	u64 tail;
+
+	for (;;) {
+		r = q->deq;
+		tail = r->tail;
+		if (tail != r->head_copy)
+			break;
+		r->head_copy = smp_load_acquire(&r->head);
+		if (tail != r->head_copy)
+			break;
+		struct spsc_ring *next = smp_load_acquire(&r->next);
+		if (!next)
+			return 0;
+		/* producer has moved on, but may have added entries before */
+		r->head_copy = READ_ONCE(r->head);
+		if (tail != r->head_copy)
+			break;
+		q->deq = next;
+		free(r);
+	}
+	*retval = r->q[tail & r->mask];
+	smp_store_release(&r->tail, tail+1);
+	return 1;
+}
+
+/*
+ * Multi-producer/single-consumer queue.  Producers claim a slot with a
+ * 64bit cmpxchg on head, write the value and then publish it by setting the
+ * slot's sequence number.  The consumer owns tail and only needs plain loads
+ * and stores.  A producer only claims a slot if head-tail says the consumer
+ * is done with it, so no slot can be overwritten before it was read.
+ *
+ * A claimed but not yet published slot makes the queue appear empty until
+ * the producer gets around to publishing it.  Ordering is the same as for
+ * the atomic queue.
+ *
+ * To grow the queue, a producer takes the lock, links a new ring and then
+ * sets RING_CLOSED in the old ring's head.  That prevents any more claims on
+ * the old ring, so the consumer knows it is done once tail has reached head.
+ * Producers may still be looking at the old ring, so the consumer has to use
+ * RCU before freeing it.
+ */
+#define RING_CLOSED	(1ull<<63)
+struct mpsc_entry {
+	u64 seq;
+	u64 val;
+};
+
+struct mpsc_ring {
+	u64 size CL_ALIGNED;
+	u64 mask;
+	struct mpsc_ring *next;
+	struct mpsc_ring *free_next;
+	u64 rcu_free_count;
+	/* producer-owned */
+	u64 head CL_ALIGNED;
+	u64 tail_copy;
+	/* consumer-owned */
+	u64 tail CL_ALIGNED;
+	/* finally - the ringbuffer */
+	struct mpsc_entry q[0] CL_ALIGNED;
+};
+
+struct mpsc_queue {
+	struct mpsc_ring *enq CL_ALIGNED;
+	u64 max_size;
+	struct lock_pi lock;
+	/* consumer-owned */
+	struct mpsc_ring *deq CL_ALIGNED;
+	struct mpsc_ring *freeq; /* newest first */
+};
+
+static struct mpsc_ring *alloc_mpsc_ring(u64 size)
+{
+	struct mpsc_ring *r = calloc(sizeof(*r) + size*sizeof(r->q[0]), 1);
+	r->size = size;
+	r->mask = size-1;
+	return r;
+}
+
+struct mpsc_queue *alloc_mpsc_queue(u64 initial_size, u64 max_size)
+{
+	rcu_init();
+	if (!initial_size)
+		initial_size = 32;
+	if (!max_size)
+		max_size = 1ull<<59;
+	assert(popcount64(initial_size) == 1);
+	assert(popcount64(max_size) == 1);
+
+	struct mpsc_queue *q = aligned_alloc(64, sizeof(*q));
+	memset(q, 0, sizeof(*q));
+	q->enq = q->deq = alloc_mpsc_ring(initial_size);
+	q->max_size = max_size;
+	return q;
+}
+
+static void free_mpsc_rings(struct mpsc_ring *r)
+{
+	while (r) {
+		struct mpsc_ring *next = r->free_next;
+		free(r);
+		r = next;
+	}
+}
+
+void free_mpsc_queue(struct mpsc_queue *q)
+{
+	struct mpsc_ring *r = q->deq;
+
+	free_mpsc_rings(q->freeq);
+	while (r) {
+		struct mpsc_ring *next = r->next;
+		free(r);
+		r = next;
+	}
+	free(q);
+}
+
+static void mpsc_grow(struct mpsc_queue *q, struct mpsc_ring *r)
+{
+	lock_pi(&q->lock);
+	if (q->enq == r) {
+		u64 size = 2 * r->size;
+		assert(size <= q->max_size);
+		struct mpsc_ring *next = alloc_mpsc_ring(size);
+		smp_store_release(&r->next, next);
+		WRITE_ONCE(q->enq, next);
+		/* producers seeing RING_CLOSED must find the new ring */
+		__sync_fetch_and_or(&r->head, RING_CLOSED);
+	}
+	unlock_pi(&q->lock);
+}
+
+void mpsc_enqueue(struct mpsc_queue *q, u64 val)
+{
+	struct mpsc_ring *r;
+	u64 head;
+
+retry:
+	rcu_lock();
+	r = READ_ONCE(q->enq);
+	head = READ_ONCE(r->head);
+	for (;;) {
+		if (head & RING_CLOSED) {
+			rcu_unlock();
+			goto retry;
+		}
+		if (head - READ_ONCE(r->tail_copy) >= r->size) {
+			u64 tail = smp_load_acquire(&r->tail);
+			WRITE_ONCE(r->tail_copy, tail);
+			if (head - tail >= r->size) {
+				rcu_unlock();
+				mpsc_grow(q, r);
+				goto retry;
+			}
+		}
+		u64 old = __sync_val_compare_and_swap(&r->head, head, head+1);
+		if (old == head)
+			break;
+		head = old;
+	}
+	struct mpsc_entry *e = &r->q[head & r->mask];
+	e->val = val;
+	smp_store_release(&e->seq, head+1);
+	rcu_unlock();
+}
+
+/* returns 0 on empty queue, 1 on dequeue */
+int mpsc_dequeue(struct mpsc_queue *q, u64 *retval)
+{
+	struct mpsc_ring *r;
+	struct mpsc_entry *e;
+	u64 tail;
+
+	for (;;) {
+		r = q->deq;
+		tail = r->tail;
+		e = &r->q[tail & r->mask];
+		if (smp_load_acquire(&e->seq) == tail+1)
+			break;
+		/* Are we done with the old rings? */
+		if (q->freeq && rcu_safe(q->freeq->rcu_free_count)) {
+			free_mpsc_rings(q->freeq);
+			q->freeq = NULL;
+		}
+		/* Empty, unless the ring was closed and we have drained it */
+		u64 head = smp_load_acquire(&r->head);
+		if (head != (tail | RING_CLOSED))
+			return 0;
+		q->deq = r->next;
+		r->free_next = q->freeq;
+		r->rcu_free_count = rcu_register();
+		q->freeq = r;
+	}
+	*retval = e->val;
+	smp_store_release(&r->tail, tail+1);
+	return 1;
+}
+
+/*
+ * Record queue.  Variable-sized messages live directly in a byte ring, so
+ * neither producer nor consumer has to allocate or copy anything.  Multiple
+ * producers, single consumer.
+ *
+ * Producers reserve space with a 64bit cmpxchg on head, write the payload in
+ * place and then commit the record by setting RECORD_COMMITTED in its header.
+ * Records never wrap around the end of the ring.  If a record doesn't fit,
+ * the producer reserves the remainder of the ring as a skip record and puts
+ * its record at the beginning.
+ *
+ * The consumer peeks at the record at tail, works on the payload in place and
+ * releases the record when done.  Releasing clears the record, so any part
+ * of the ring that isn't reserved is always zero.  Without that a consumer
+ * could mistake stale data from a previous lap for a committed header before
+ * the producer got around to writing it.
+ *
+ * Payloads are 8-byte aligned.  The ring doesn't grow, the consumer holds
+ * pointers into it.  record_reserve() returns NULL when the ring is full.
+ */
+#define RECORD_COMMITTED	(1ull<<32)
+#define RECORD_SKIP		(1ull<<33)
+#define RECORD_LEN_MASK		(0xffffffffull)
+struct record_queue {
+	u64 size CL_ALIGNED;
+	u64 mask;
+	/* producer-owned */
+	u64 head CL_ALIGNED;
+	u64 tail_copy;
+	/* consumer-owned */
+	u64 tail CL_ALIGNED;
+	/* finally - the ringbuffer */
+	u8 data[0] CL_ALIGNED;
+};
+
+static inline u64 *record_hdr(struct record_queue *q, u64 pos)
+{
+	return (u64 *)&q->data[pos & q->mask];
+}
+
+static inline u64 record_total(u64 len)
+{
+	return sizeof(u64) + ALIGN_UP(len, sizeof(u64));
+}
+
+/* size is in bytes and must be a power of two */
+struct record_queue *alloc_record_queue(u64 size)
+{
+	assert(popcount64(size) == 1);
+	assert(size >= 64);
+	struct record_queue *q = aligned_alloc(64, sizeof(*q) + size);
+	memset(q, 0, sizeof(*q) + size);
+	q->size = size;
+	q->mask = size-1;
+	return q;
+}
+
+void free_record_queue(struct record_queue *q)
+{
+	free(q);
+}
+
+/* returns a pointer to len bytes of payload, NULL if the ring is full */
+void *record_reserve(struct record_queue *q, u32 len)
+{
+	u64 total = record_total(len);
+	u64 head = READ_ONCE(q->head);
+	u64 pad, old;
+
+	/* catch blatant bugs, anything larger can never fit */
+	assert(total <= q->size/2);
+	for (;;) {
+		u64 offset = head & q->mask;
+		pad = offset + total > q->size ? q->size - offset : 0;
+		if (head + pad + total - READ_ONCE(q->tail_copy) > q->size) {
+			u64 tail = smp_load_acquire(&q->tail);
+			WRITE_ONCE(q->tail_copy, tail);
+			if (head + pad + total - tail > q->size)
+				return NULL;
+		}
+		old = __sync_val_compare_and_swap(&q->head, head, head + pad + total);
+		if (old == head)
+			break;
+		head = old;
+	}
+	if (pad) {
+		smp_store_release(record_hdr(q, head), pad | RECORD_SKIP | RECORD_COMMITTED);
+		head += pad;
+	}
+	u64 *hdr = record_hdr(q, head);
+	WRITE_ONCE(*hdr, len);
+	return hdr+1;
+}
+
+/* makes a reserved record visible to the consumer */
+void record_commit(void *payload)
+{
+	u64 *hdr = (u64 *)payload - 1;
+	smp_store_release(hdr, *hdr | RECORD_COMMITTED);
+}
+
+/*
+ * Returns a pointer to the oldest record's payload and its length, NULL on
+ * empty queue.  The record stays in the queue until record_release().
+ * Records are committed out of order, but only dequeued in order, so one slow
+ * producer can hold up the consumer.
+ */
+void *record_peek(struct record_queue *q, u32 *len)
+{
+	for (;;) {
+		u64 tail = q->tail;
+		u64 *hdr = record_hdr(q, tail);
+		u64 h = smp_load_acquire(hdr);
+		if (!(h & RECORD_COMMITTED))
+			return NULL;
+		if (h & RECORD_SKIP) {
+			/* remainder of the skip record was never written */
+			*hdr = 0;
+			smp_store_release(&q->tail, tail + (h & RECORD_LEN_MASK));
+			continue;
+		}
+		*len = h & RECORD_LEN_MASK;
+		return hdr+1;
+	}
+}
+
+/* releases the record returned by the last record_peek() */
+void record_release(struct record_queue *q, void *payload)
+{
+	u64 *hdr = (u64 *)payload - 1;
+	u64 total = record_total(*hdr & RECORD_LEN_MASK);
+
+	assert(hdr == record_hdr(q, q->tail));
+	memset(hdr, 0, total);
+	smp_store_release(&q->tail, q->tail + total);
 }
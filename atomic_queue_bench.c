@@ -0,0 +1,107 @@
+/*
+ * Throughput benchmark for atomic_queue and sharded_queue.
+ *
+ * Runs the same number of producer and consumer threads against each queue
+ * and reports millions of operations per second.  Each producer enqueues a
+ * fixed number of entries, consumers dequeue until everything has been
+ * consumed.  Run with the largest thread count as argument, e.g.
+ *	gcc -O2 -mcx16 -pthread atomic_queue_bench.c -o atomic_queue_bench
+ *	./atomic_queue_bench 64
+ * Thread counts are doubled from 2 until they reach the argument.  Numbers
+ * are only meaningful with at least that many cores.
+ */
+#include "atomic_queue.c"
+
+#define OPS_PER_PRODUCER	(1<<20)
+
+struct bench {
+	const char *name;
+	void *q;
+	void *(*alloc)(void);
+	void (*free)(void *q);
+	void (*enqueue)(void *q, u64 val);
+	int (*dequeue)(void *q, u64 *val);
+	u64 remaining;
+	u64 start;
+};
+
+static void *ordered_alloc(void)		{ return alloc_queue(1<<10, 0); }
+static void ordered_free(void *q)		{ free_queue(q); }
+static void ordered_enqueue(void *q, u64 val)	{ enqueue(q, val); }
+static int ordered_dequeue(void *q, u64 *val)	{ return dequeue(q, val); }
+static void *sharded_alloc(void)		{ return alloc_sharded_queue(1<<10, 0, 0); }
+static void sharded_free(void *q)		{ free_sharded_queue(q); }
+static void sharded_enqueue_(void *q, u64 val)	{ sharded_enqueue(q, val); }
+static int sharded_dequeue_(void *q, u64 *val)	{ return sharded_dequeue(q, val); }
+
+static void *producer(void *arg)
+{
+	struct bench *b = arg;
+
+	while (!READ_ONCE(b->start))
+		cpu_relax();
+	for (u64 i=0; i<OPS_PER_PRODUCER; i++)
+		b->enqueue(b->q, i);
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	struct bench *b = arg;
+	u64 val;
+
+	while (!READ_ONCE(b->start))
+		cpu_relax();
+	while (READ_ONCE(b->remaining)) {
+		if (b->dequeue(b->q, &val))
+			atomic_dec(&b->remaining);
+		else
+			cpu_relax();
+	}
+	return NULL;
+}
+
+static double run(struct bench *b, int threads)
+{
+	pthread_t tid[2*threads];
+	struct timespec t0, t1;
+
+	b->q = b->alloc();
+	b->remaining = (u64)threads * OPS_PER_PRODUCER;
+	b->start = 0;
+	for (int i=0; i<threads; i++) {
+		pthread_create(&tid[2*i], NULL, producer, b);
+		pthread_create(&tid[2*i+1], NULL, consumer, b);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	WRITE_ONCE(b->start, 1);
+	for (int i=0; i<2*threads; i++)
+		pthread_join(tid[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	b->free(b->q);
+
+	double ns = (t1.tv_sec-t0.tv_sec)*1e9 + (t1.tv_nsec-t0.tv_nsec);
+	/* one op is an enqueue/dequeue pair */
+	return threads * OPS_PER_PRODUCER * 1e3 / ns;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench benches[] = {
+		{ "ordered", NULL, ordered_alloc, ordered_free, ordered_enqueue, ordered_dequeue },
+		{ "sharded", NULL, sharded_alloc, sharded_free, sharded_enqueue_, sharded_dequeue_ },
+	};
+	int max_threads = argc>1 ? atoi(argv[1]) : 64;
+
+	printf("threads");
+	for (int i=0; i<ARRAY_SIZE(benches); i++)
+		printf(" %10s", benches[i].name);
+	printf("   (Mops/s)\n");
+	for (int threads=2; threads<=max_threads; threads*=2) {
+		printf("%7d", threads);
+		for (int i=0; i<ARRAY_SIZE(benches); i++)
+			printf(" %10.2f", run(&benches[i], threads/2));
+		printf("\n");
+	}
+	return 0;
+}
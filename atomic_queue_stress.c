@@ -0,0 +1,465 @@
+/*
+ * Stress test and latency benchmark for atomic_queue and its variants.
+ *
+ *	gcc -O2 -mcx16 -pthread atomic_queue_stress.c -o atomic_queue_stress
+ *	./atomic_queue_stress -p 32 -c 32 -n 1000000 -s 2
+ *
+ * -p producers, -c consumers, -n entries per producer, -s initial queue size
+ * -t queue type: atomic (default), sharded, mpsc or spsc, or one of
+ *	bounded	- AQ_BOUNDED queue, producers alternate between spinning on
+ *		  try_enqueue() and enqueue_wait() with a 10us timeout,
+ *		  consumers use dequeue_wait() with a 100us timeout
+ *	wait	- regular queue, consumers sleep in dequeue_wait()
+ *	eventfd	- one consumer sleeping in poll() on queue_eventfd() and
+ *		  emptying the queue with queue_drain()
+ *	record	- record ring of 64 bytes per entry but at least 4KiB,
+ *		  records of 8 to 64 bytes with a payload the consumer checks
+ *	prio	- priority queue, producer i enqueues to level i%4
+ *
+ * -t shrink is different.  It grows an AQ_SHRINK queue to 64 times its
+ * initial size, lets -c consumers drain it and park in dequeue_wait()
+ * and checks that the queue shrinks back to its initial size anyway.
+ *
+ * Every entry encodes producer id and sequence number.  Consumers verify
+ * that they see each producer's entries in increasing order and mark every
+ * entry in a bitmap to catch duplicates.  At the end the bitmap has to be
+ * full, otherwise we lost entries.  A tiny initial size forces lots of grows
+ * and RCU handoffs, which is where the interesting bugs hide.
+ *
+ * Latencies are per enqueue()/dequeue() call, measured in core cycles.
+ * Dequeue latency only counts successful dequeues.
+ */
+#include <getopt.h>
+#include <poll.h>
+#include "atomic_queue.c"
+
+#define SEQ_BITS	40
+#define SEQ_MASK	((1ull<<SEQ_BITS)-1)
+
+static u64 nr_producers = 4;
+static u64 nr_consumers = 4;
+static u64 nr_ops = 1<<20;
+static u64 initial_size = 2;
+static u64 *seen;		/* bitmap, one bit per entry */
+static u64 remaining;
+static u64 start;
+static u64 tsc_per_64k_cycles;
+
+static void *q;
+static void (*q_enqueue)(void *q, u64 val);
+static int (*q_dequeue)(void *q, u64 *val);
+
+static void atomic_enqueue_(void *p, u64 val)	{ enqueue(p, val); }
+static int atomic_dequeue_(void *p, u64 *val)	{ return dequeue(p, val); }
+static void sharded_enqueue_(void *p, u64 val)	{ sharded_enqueue(p, val); }
+static int sharded_dequeue_(void *p, u64 *val)	{ return sharded_dequeue(p, val); }
+static void mpsc_enqueue_(void *p, u64 val)	{ mpsc_enqueue(p, val); }
+static int mpsc_dequeue_(void *p, u64 *val)	{ return mpsc_dequeue(p, val); }
+static void spsc_enqueue_(void *p, u64 val)	{ spsc_enqueue(p, val); }
+static int spsc_dequeue_(void *p, u64 *val)	{ return spsc_dequeue(p, val); }
+static int wait_dequeue_(void *p, u64 *val)	{ return dequeue_wait(p, val, 100000); }
+
+/*
+ * Odd entries retry try_enqueue(), even ones sleep with a short timeout.
+ * Retries yield, the consumer may need our CPU to make room.
+ */
+static void bounded_enqueue_(void *p, u64 val)
+{
+	if (val & 1) {
+		while (!try_enqueue(p, val))
+			sched_yield();
+	} else {
+		while (!enqueue_wait(p, val, 10000))
+			;
+	}
+}
+
+#define PRIO_LEVELS	4
+static void prio_enqueue_(void *p, u64 val)
+{
+	/* one level per producer, or we lose the order */
+	prio_enqueue(p, (val >> SEQ_BITS) % PRIO_LEVELS, val);
+}
+static int prio_dequeue_(void *p, u64 *val)	{ return prio_dequeue(p, val); }
+
+/* the entry itself, then len-8 copies of its low byte */
+#define RECORD_BYTES	64
+static u32 record_len(u64 val)
+{
+	return sizeof(val) + val % (RECORD_BYTES - sizeof(val) + 1);
+}
+
+static void record_enqueue_(void *p, u64 val)
+{
+	u32 len = record_len(val);
+	u8 *payload;
+
+	while (!(payload = record_reserve(p, len)))
+		sched_yield();
+	memcpy(payload, &val, sizeof(val));
+	memset(payload + sizeof(val), (u8)val, len - sizeof(val));
+	record_commit(payload);
+}
+
+static int record_dequeue_(void *p, u64 *val)
+{
+	u32 len;
+	u8 *payload = record_peek(p, &len);
+
+	if (!payload)
+		return 0;
+	memcpy(val, payload, sizeof(*val));
+	if (len != record_len(*val)) {
+		fprintf(stderr, "record %llx: %d bytes, expected %d\n", *val, len, record_len(*val));
+		abort();
+	}
+	for (u32 i=sizeof(*val); i<len; i++) {
+		if (payload[i] != (u8)*val) {
+			fprintf(stderr, "record %llx: corrupt payload at %d\n", *val, i);
+			abort();
+		}
+	}
+	record_release(p, payload);
+	return 1;
+}
+
+static inline u64 loop16(void)
+{
+	u64 t = rdtsc();
+	u64 rcx = 1ull<<16;
+	asm volatile ("1: sub $1, %%rcx; jg 1b" : "+c" (rcx));
+	t = rdtsc() - t;
+	return t;
+}
+
+/*
+ * Log-linear histogram of core cycles.  16 buckets per power of two keep
+ * the error for percentiles below 7%.
+ */
+#define HGRAM_SUB	16
+struct hgram {
+	u64 b[64*HGRAM_SUB];
+};
+
+static u32 hgram_bucket(u64 c)
+{
+	if (c < HGRAM_SUB)
+		return c;
+	u32 log = 63 - __builtin_clzll(c);
+	return (log-3) * HGRAM_SUB + ((c >> (log-4)) & (HGRAM_SUB-1));
+}
+
+static u64 hgram_value(u32 b)
+{
+	if (b < HGRAM_SUB)
+		return b;
+	u32 log = b/HGRAM_SUB + 3;
+	return (HGRAM_SUB + b%HGRAM_SUB) << (log-4);
+}
+
+static inline void hgram_add(struct hgram *h, u64 tsc)
+{
+	u128 c = tsc;
+	c <<= 16;
+	h->b[hgram_bucket(c / tsc_per_64k_cycles)]++;
+}
+
+static void hgram_merge(struct hgram *dst, struct hgram *src)
+{
+	for (int i=0; i<ARRAY_SIZE(dst->b); i++)
+		dst->b[i] += src->b[i];
+}
+
+static void hgram_print(struct hgram *h, const char *name)
+{
+	static const double pct[] = { 50, 99, 99.9 };
+	u64 total = 0, sum = 0;
+	int p = 0;
+
+	for (int i=0; i<ARRAY_SIZE(h->b); i++)
+		total += h->b[i];
+	printf("%-8s", name);
+	for (int i=0; i<ARRAY_SIZE(h->b) && p<ARRAY_SIZE(pct); i++) {
+		sum += h->b[i];
+		while (p<ARRAY_SIZE(pct) && sum >= total*pct[p]/100) {
+			printf("  p%-4g %7lld", pct[p], hgram_value(i));
+			p++;
+		}
+	}
+	printf("  cycles\n");
+}
+
+struct thread {
+	pthread_t tid;
+	u64 id;
+	u64 *last;	/* consumer: last sequence number per producer */
+	struct hgram h;
+};
+
+static void *producer(void *arg)
+{
+	struct thread *t = arg;
+
+	while (!READ_ONCE(start))
+		cpu_relax();
+	for (u64 seq=0; seq<nr_ops; seq++) {
+		u64 tsc = rdtsc();
+		q_enqueue(q, t->id<<SEQ_BITS | seq);
+		hgram_add(&t->h, rdtsc() - tsc);
+	}
+	return NULL;
+}
+
+static void check_entry(struct thread *t, u64 val)
+{
+	u64 id = val >> SEQ_BITS;
+	u64 seq = val & SEQ_MASK;
+
+	atomic_dec(&remaining);
+	assert(id < nr_producers && seq < nr_ops);
+	if (t->last[id] != -1ull && seq <= t->last[id]) {
+		fprintf(stderr, "producer %lld: %lld after %lld\n", id, seq, t->last[id]);
+		abort();
+	}
+	t->last[id] = seq;
+	u64 bit = id*nr_ops + seq;
+	u64 old = __sync_fetch_and_or(&seen[bit/64], 1ull<<(bit%64));
+	if (old & 1ull<<(bit%64)) {
+		fprintf(stderr, "producer %lld: %lld duplicate\n", id, seq);
+		abort();
+	}
+}
+
+static void *consumer(void *arg)
+{
+	struct thread *t = arg;
+	u64 val;
+
+	while (!READ_ONCE(start))
+		cpu_relax();
+	while (READ_ONCE(remaining)) {
+		u64 tsc = rdtsc();
+		if (!q_dequeue(q, &val)) {
+			cpu_relax();
+			continue;
+		}
+		hgram_add(&t->h, rdtsc() - tsc);
+		check_entry(t, val);
+	}
+	return NULL;
+}
+
+static void drain_batch(void *arg, u64 *vals, u64 n)
+{
+	for (u64 i=0; i<n; i++)
+		check_entry(arg, vals[i]);
+}
+
+/*
+ * Sleeps in poll() until the eventfd fires.  A second without an event
+ * while entries are missing means a producer didn't write the eventfd, or
+ * the producers got stuck, so we check.  Latency is per queue_drain().
+ */
+static void *eventfd_consumer(void *arg)
+{
+	struct thread *t = arg;
+	struct pollfd pfd = { .fd = queue_eventfd(q), .events = POLLIN };
+
+	while (!READ_ONCE(start))
+		cpu_relax();
+	while (READ_ONCE(remaining)) {
+		int ret = poll(&pfd, 1, 1000);
+		assert(ret >= 0);
+		u64 tsc = rdtsc();
+		u64 n = queue_drain(q, drain_batch, t);
+		hgram_add(&t->h, rdtsc() - tsc);
+		if (!ret && n) {
+			fprintf(stderr, "%lld entries without an eventfd wakeup\n", n);
+			abort();
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Consumers sleeping in dequeue_wait() never poll.  The queue still has to
+ * shrink, one halving per SHRINK_NS or so.
+ */
+#define SHRINK_GROWTH	64
+#define SHRINK_STOP	-1ull
+static void *parked_consumer(void *arg)
+{
+	u64 val;
+
+	for (;;) {
+		int ret = dequeue_wait(q, &val, -1ull);
+		assert(ret);
+		if (val == SHRINK_STOP)
+			return NULL;
+	}
+}
+
+static int shrink_test(void)
+{
+	struct queue_stats stats;
+	pthread_t *tid = calloc(nr_consumers, sizeof(*tid));
+
+	q = alloc_queue_flags(initial_size, 0, AQ_SHRINK);
+	for (u64 i=0; i<SHRINK_GROWTH*initial_size; i++)
+		enqueue(q, i);
+	queue_stats(q, &stats);
+	u64 grown = stats.size;
+	for (u64 i=0; i<nr_consumers; i++)
+		pthread_create(&tid[i], NULL, parked_consumer, NULL);
+
+	u64 t0 = get_monotonic();
+	/* 6 halvings, each takes SHRINK_NS plus a few ticks */
+	u64 deadline = t0 + 30 * SHRINK_NS;
+	do {
+		usleep(100000);
+		queue_stats(q, &stats);
+	} while (stats.size > initial_size && get_monotonic() < deadline);
+	if (stats.size > initial_size) {
+		fprintf(stderr, "queue stuck at %lld entries, grown to %lld\n", stats.size, grown);
+		abort();
+	}
+	u64 ns = get_monotonic() - t0;
+	for (u64 i=0; i<nr_consumers; i++)
+		enqueue(q, SHRINK_STOP);
+	for (u64 i=0; i<nr_consumers; i++)
+		pthread_join(tid[i], NULL);
+	printf("shrink queue, %lld parked consumers, %lld -> %lld entries in %.1fs: ok\n",
+			nr_consumers, grown, stats.size, ns / 1e9);
+	printf("%lld grows, %lld shrinks\n", stats.grows, stats.shrinks);
+	free_queue(q);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *type = "atomic";
+	void *(*consumer_fn)(void *) = consumer;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:c:n:s:t:")) != -1) {
+		switch (c) {
+		case 'p': nr_producers = atoll(optarg); break;
+		case 'c': nr_consumers = atoll(optarg); break;
+		case 'n': nr_ops = atoll(optarg); break;
+		case 's': initial_size = atoll(optarg); break;
+		case 't': type = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-p producers] [-c consumers] [-n ops] [-s size] [-t atomic|sharded|mpsc|spsc|bounded|wait|eventfd|record|prio|shrink]\n", argv[0]);
+			return 1;
+		}
+	}
+	assert(nr_ops <= SEQ_MASK);
+	if (!strcmp(type, "shrink"))
+		return shrink_test();
+	if (!strcmp(type, "atomic")) {
+		q = alloc_queue(initial_size, 0);
+		q_enqueue = atomic_enqueue_;
+		q_dequeue = atomic_dequeue_;
+	} else if (!strcmp(type, "sharded")) {
+		q = alloc_sharded_queue(initial_size, 0, 0);
+		q_enqueue = sharded_enqueue_;
+		q_dequeue = sharded_dequeue_;
+	} else if (!strcmp(type, "mpsc")) {
+		assert(nr_consumers == 1);
+		q = alloc_mpsc_queue(initial_size, 0);
+		q_enqueue = mpsc_enqueue_;
+		q_dequeue = mpsc_dequeue_;
+	} else if (!strcmp(type, "spsc")) {
+		assert(nr_producers == 1 && nr_consumers == 1);
+		q = alloc_spsc_queue(initial_size, 0);
+		q_enqueue = spsc_enqueue_;
+		q_dequeue = spsc_dequeue_;
+	} else if (!strcmp(type, "bounded")) {
+		q = alloc_queue_flags(initial_size, 0, AQ_BOUNDED);
+		q_enqueue = bounded_enqueue_;
+		q_dequeue = wait_dequeue_;
+	} else if (!strcmp(type, "wait")) {
+		q = alloc_queue(initial_size, 0);
+		q_enqueue = atomic_enqueue_;
+		q_dequeue = wait_dequeue_;
+	} else if (!strcmp(type, "eventfd")) {
+		assert(nr_consumers == 1);
+		q = alloc_queue(initial_size, 0);
+		q_enqueue = atomic_enqueue_;
+		q_dequeue = atomic_dequeue_;
+		consumer_fn = eventfd_consumer;
+	} else if (!strcmp(type, "record")) {
+		assert(nr_consumers == 1);
+		/* the ring doesn't grow, so a tiny one only measures sched_yield() */
+		u64 size = initial_size * RECORD_BYTES;
+		q = alloc_record_queue(size < 4096 ? 4096 : size);
+		q_enqueue = record_enqueue_;
+		q_dequeue = record_dequeue_;
+	} else if (!strcmp(type, "prio")) {
+		q = alloc_prio_queue(PRIO_LEVELS, initial_size, 0);
+		q_enqueue = prio_enqueue_;
+		q_dequeue = prio_dequeue_;
+	} else {
+		fprintf(stderr, "unknown queue type %s\n", type);
+		return 1;
+	}
+
+	tsc_per_64k_cycles = loop16();
+	u64 total = nr_producers * nr_ops;
+	seen = calloc(total/64 + 1, sizeof(u64));
+	remaining = total;
+
+	struct thread *prod = calloc(nr_producers, sizeof(*prod));
+	struct thread *cons = calloc(nr_consumers, sizeof(*cons));
+	for (u64 i=0; i<nr_producers; i++) {
+		prod[i].id = i;
+		pthread_create(&prod[i].tid, NULL, producer, &prod[i]);
+	}
+	for (u64 i=0; i<nr_consumers; i++) {
+		cons[i].last = malloc(nr_producers * sizeof(u64));
+		memset(cons[i].last, 0xff, nr_producers * sizeof(u64));
+		pthread_create(&cons[i].tid, NULL, consumer_fn, &cons[i]);
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	WRITE_ONCE(start, 1);
+	struct hgram *henq = calloc(1, sizeof(*henq));
+	struct hgram *hdeq = calloc(1, sizeof(*hdeq));
+	for (u64 i=0; i<nr_producers; i++) {
+		pthread_join(prod[i].tid, NULL);
+		hgram_merge(henq, &prod[i].h);
+	}
+	for (u64 i=0; i<nr_consumers; i++) {
+		pthread_join(cons[i].tid, NULL);
+		hgram_merge(hdeq, &cons[i].h);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (u64 bit=0; bit<total; bit++) {
+		if (!(seen[bit/64] & 1ull<<(bit%64))) {
+			fprintf(stderr, "producer %lld: %lld lost\n", bit/nr_ops, bit%nr_ops);
+			abort();
+		}
+	}
+	u64 val;
+	if (q_dequeue(q, &val)) {
+		fprintf(stderr, "queue not empty\n");
+		abort();
+	}
+
+	double ns = (t1.tv_sec-t0.tv_sec)*1e9 + (t1.tv_nsec-t0.tv_nsec);
+	printf("%s queue, %lld producers, %lld consumers, %lld entries: ok\n",
+			type, nr_producers, nr_consumers, total);
+	printf("%.2f Mops/s\n", total * 1e3 / ns);
+	hgram_print(henq, "enqueue");
+	hgram_print(hdeq, "dequeue");
+	if (!strcmp(type, "atomic") || !strcmp(type, "wait") || !strcmp(type, "bounded")) {
+		struct queue_stats stats;
+		queue_stats(q, &stats);
+		printf("size %lld, %lld grows, %lldns max grow lock hold, %lld/%lld collisions\n",
+				stats.size, stats.grows, stats.grow_max_ns,
+				stats.enqueue_collisions, stats.dequeue_collisions);
+	}
+	return 0;
+}
@@ -0,0 +1,642 @@
+/*
+ * Cross-process version of the atomic queue.
+ *
+ * The queue lives in a POSIX shared memory object, so unrelated processes
+ * can exchange u64 messages without syscalls or copies.  Enqueue and dequeue
+ * are the same lock-free code as the in-process atomic queue, operating on
+ * the same struct subqueue.  What differs:
+ *
+ * - Each process maps the object at a different address, so subqueues are
+ *   linked by offsets instead of the subq->next pointers.
+ *
+ * - The object can't be moved once mapped.  We reserve enough address space
+ *   for every subqueue up to max_size when mapping it and grow the file
+ *   with ftruncate().  Other processes don't have to remap anything.
+ *
+ * - RCU counters live in the shared header.  Processes can die at any time,
+ *   including inside a critical section.  When a dead reader blocks
+ *   progress, we notice with tgkill(pid, tid, 0) and reclaim its slot.
+ *   That requires all processes to share a pid namespace.
+ *
+ * - The grow lock is a process-shared, robust PI mutex.  glibc puts it on
+ *   the owner's robust futex list, so the kernel marks it FUTEX_OWNER_DIED
+ *   and wakes a waiter if the owner dies holding it.  The next locker gets
+ *   EOWNERDEAD and finishes whatever the dead owner was doing.  Every step
+ *   under the lock is idempotent, a half-finished grow only leaks space.
+ *
+ * Old subqueues are never reused, their address range is merely released
+ * with MADV_REMOVE.  Total reservation is a bit more than twice
+ * max_size*16 bytes, so pick max_size with care.
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "atomic_queue.c"
+
+#define SHM_MAGIC		0x617175657565756dull	/* "mueueuqa" */
+#define SHM_MAX_READERS		4096
+#define SHM_PAGE_SIZE		4096
+#define SHM_DEFAULT_MAX_SIZE	(1ull<<24)
+
+struct shm_reader {
+	u64 count CL_ALIGNED;
+	u32 pid;
+	u32 tid;
+};
+
+struct shm_subqueue {
+	u64 next_off CL_ALIGNED;
+	struct subqueue subq;
+};
+
+struct shm_header {
+	u64 magic;
+	u64 map_size;	/* reserved address space */
+	u64 file_size;	/* end of the last subqueue */
+	u64 max_size;
+	u64 enq_off;
+	u64 deq_off;
+	u64 freeq_off;
+	u64 rcu_free_count;
+	u64 grow_off;	/* old enqueue subqueue, rcu_dequeue_count not yet set */
+	pthread_mutex_t lock;
+	/* rcu */
+	u64 rcu_count CL_ALIGNED;
+	u64 rcu_safe;
+	u32 nr_readers;
+	struct shm_reader readers[SHM_MAX_READERS];
+};
+
+/* process-local handle */
+struct shm_queue {
+	struct shm_header *hdr;
+	int fd;
+};
+
+static inline void *shm_ptr(struct shm_queue *q, u64 off)
+{
+	return (void *)q->hdr + off;
+}
+
+static inline u64 shm_offset(struct shm_queue *q, void *p)
+{
+	return p - (void *)q->hdr;
+}
+
+static u64 shm_subqueue_bytes(u64 size)
+{
+	u64 bytes = sizeof(struct shm_subqueue) + size*sizeof(struct entry);
+	return ALIGN_UP(bytes, SHM_PAGE_SIZE);
+}
+
+static int shm_alive(u32 pid, u32 tid)
+{
+	return syscall(SYS_tgkill, pid, tid, 0) == 0 || errno != ESRCH;
+}
+
+static void shm_lock_init(pthread_mutex_t *l)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	int err = pthread_mutex_init(l, &attr);
+	assert(!err);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/* Survives the owner dying, callers must cope with a half-done job */
+static void shm_lock(pthread_mutex_t *l)
+{
+	int err = pthread_mutex_lock(l);
+	if (err == EOWNERDEAD)
+		err = pthread_mutex_consistent(l);
+	assert(!err);
+}
+
+static void shm_unlock(pthread_mutex_t *l)
+{
+	pthread_mutex_unlock(l);
+}
+
+static __thread struct shm_header *local_shm_hdr;
+static __thread struct shm_reader *local_shm_rcu;
+
+/* The child is a different pid and must not share our reader slot */
+static void shm_fork_child(void)
+{
+	local_shm_hdr = NULL;
+}
+
+static void shm_init_once(void)
+{
+	pthread_atfork(NULL, NULL, shm_fork_child);
+}
+
+static struct shm_reader *shm_rcu_register_thread(struct shm_header *h)
+{
+	u32 pid = getpid();
+	u32 tid = gettid();
+	u32 nr = READ_ONCE(h->nr_readers);
+	struct shm_reader *r;
+
+	/* our thread may have registered before */
+	for (u32 i=0; i<nr; i++) {
+		r = &h->readers[i];
+		if (READ_ONCE(r->pid) == pid && READ_ONCE(r->tid) == tid
+				&& READ_ONCE(r->count) == RCU_UNLOCKED)
+			return r;
+	}
+	/*
+	 * Claim with 0, which shm_rcu_safe() and reclaimers ignore, and only
+	 * publish the slot once pid and tid are ours.
+	 */
+	for (u32 i=0; i<nr; i++) {
+		r = &h->readers[i];
+		if (READ_ONCE(r->count) != RCU_UNUSED)
+			continue;
+		if (cmpxchg64(&r->count, RCU_UNUSED, 0))
+			goto out;
+	}
+	/*
+	 * Threads that died outside of a critical section leave their slot
+	 * RCU_UNLOCKED.  Reclaim one of those before using a new slot.  Only
+	 * the owner and reclaimers write to such slots, so the lock is enough.
+	 */
+	shm_lock(&h->lock);
+	for (u32 i=0; i<nr; i++) {
+		r = &h->readers[i];
+		if (READ_ONCE(r->count) != RCU_UNLOCKED)
+			continue;
+		if (shm_alive(READ_ONCE(r->pid), READ_ONCE(r->tid)))
+			continue;
+		WRITE_ONCE(r->pid, pid);
+		WRITE_ONCE(r->tid, tid);
+		shm_unlock(&h->lock);
+		return r;
+	}
+	shm_unlock(&h->lock);
+	u32 i = atomic_inc(&h->nr_readers);
+	assert(i < SHM_MAX_READERS);
+	r = &h->readers[i];
+out:
+	WRITE_ONCE(r->pid, pid);
+	WRITE_ONCE(r->tid, tid);
+	mb();
+	WRITE_ONCE(r->count, RCU_UNLOCKED);
+	return r;
+}
+
+static void shm_rcu_lock(struct shm_queue *q)
+{
+	if (local_shm_hdr != q->hdr) {
+		local_shm_rcu = shm_rcu_register_thread(q->hdr);
+		local_shm_hdr = q->hdr;
+	}
+	assert(local_shm_rcu->count == RCU_UNLOCKED);
+	/* full barrier, see rcu_lock() */
+	__sync_lock_test_and_set(&local_shm_rcu->count, READ_ONCE(q->hdr->rcu_count));
+}
+
+static void shm_rcu_unlock(struct shm_queue *q)
+{
+	mb();
+	WRITE_ONCE(local_shm_rcu->count, RCU_UNLOCKED);
+}
+
+static u64 shm_rcu_register(struct shm_header *h)
+{
+	return atomic_inc(&h->rcu_count);
+}
+
+static int shm_rcu_safe(struct shm_header *h, u64 count)
+{
+	if (count <= READ_ONCE(h->rcu_safe))
+		return 1;
+	u32 nr = READ_ONCE(h->nr_readers);
+	for (u32 i=0; i<nr; i++) {
+		struct shm_reader *r = &h->readers[i];
+		u64 c = READ_ONCE(r->count);
+		/* 0 is a slot that is still being set up */
+		if (!c || c > count)
+			continue;
+		if (shm_alive(READ_ONCE(r->pid), READ_ONCE(r->tid)))
+			return 0;
+		/* reader died inside a critical section */
+		cmpxchg64(&r->count, c, RCU_UNUSED);
+	}
+	WRITE_ONCE(h->rcu_safe, count);
+	return 1;
+}
+
+static struct shm_queue *shm_map(int fd)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	struct shm_header *h;
+	struct stat st;
+	u64 map_size;
+
+	pthread_once(&once, shm_init_once);
+	/* the creator hasn't called ftruncate() yet, reading would SIGBUS */
+	if (fstat(fd, &st) || st.st_size < sizeof(*h))
+		return NULL;
+	h = mmap(NULL, sizeof(*h), PROT_READ, MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED)
+		return NULL;
+	map_size = READ_ONCE(h->map_size);
+	munmap(h, sizeof(*h));
+	if (map_size < sizeof(*h))
+		return NULL;
+
+	/* reserve address space for all future subqueues */
+	h = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, fd, 0);
+	if (h == MAP_FAILED)
+		return NULL;
+	struct shm_queue *q = malloc(sizeof(*q));
+	q->hdr = h;
+	q->fd = fd;
+	return q;
+}
+
+/* Must be called with the lock held, returns offset of the new subqueue */
+static u64 shm_alloc_subqueue(struct shm_queue *q, u64 size)
+{
+	struct shm_header *h = q->hdr;
+	u64 off = h->file_size;
+	u64 bytes = shm_subqueue_bytes(size);
+
+	assert(off + bytes <= h->map_size);
+	/* If we die here, the next grow will simply use more space */
+	int err = ftruncate(q->fd, off + bytes);
+	assert(!err);
+	WRITE_ONCE(h->file_size, off + bytes);
+
+	struct shm_subqueue *sq = shm_ptr(q, off);
+	sq->subq.size = size;
+	sq->subq.mask = size-1;
+	sq->subq.max_size = h->max_size;
+	return off;
+}
+
+/*
+ * Creates a new queue, name as for shm_open().  Fails if the name already
+ * exists.  max_size defaults to 16M entries, which reserves 512MiB of
+ * address space in every process that maps the queue.
+ */
+struct shm_queue *shm_queue_create(const char *name, u64 initial_size, u64 max_size)
+{
+	if (!initial_size)
+		initial_size = 32;
+	if (!max_size)
+		max_size = SHM_DEFAULT_MAX_SIZE;
+	assert(popcount64(initial_size) == 1);
+	assert(popcount64(max_size) == 1);
+	assert(initial_size <= max_size);
+
+	u64 map_size = ALIGN_UP(sizeof(struct shm_header), SHM_PAGE_SIZE);
+	for (u64 size=initial_size; size<=max_size; size*=2)
+		map_size += shm_subqueue_bytes(size);
+
+	int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, sizeof(struct shm_header)))
+		goto err;
+	struct shm_header *h = mmap(NULL, sizeof(*h), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED)
+		goto err;
+	h->map_size = map_size;
+	h->file_size = ALIGN_UP(sizeof(struct shm_header), SHM_PAGE_SIZE);
+	h->max_size = max_size;
+	h->rcu_count = 1;
+	shm_lock_init(&h->lock);
+	munmap(h, sizeof(*h));
+
+	struct shm_queue *q = shm_map(fd);
+	if (!q)
+		goto err;
+	h = q->hdr;
+	h->enq_off = h->deq_off = shm_alloc_subqueue(q, initial_size);
+	/* Opening processes check the magic, so set it last */
+	mb();
+	WRITE_ONCE(h->magic, SHM_MAGIC);
+	return q;
+err:
+	close(fd);
+	shm_unlink(name);
+	return NULL;
+}
+
+/* Unmaps the queue.  The queue itself remains until shm_unlink(). */
+void shm_queue_close(struct shm_queue *q)
+{
+	if (local_shm_hdr == q->hdr)
+		local_shm_hdr = NULL;
+	munmap(q->hdr, q->hdr->map_size);
+	close(q->fd);
+	free(q);
+}
+
+/* Opens an existing queue.  Returns NULL if it isn't fully created yet. */
+struct shm_queue *shm_queue_open(const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+	struct shm_queue *q = shm_map(fd);
+	if (!q || READ_ONCE(q->hdr->magic) != SHM_MAGIC
+			|| READ_ONCE(q->hdr->file_size) > q->hdr->map_size) {
+		if (q)
+			shm_queue_close(q);
+		else
+			close(fd);
+		return NULL;
+	}
+	return q;
+}
+
+void shm_enqueue(struct shm_queue *q, u64 val)
+{
+	struct shm_header *h = q->hdr;
+retry:
+	shm_rcu_lock(q);
+	struct shm_subqueue *sq = shm_ptr(q, READ_ONCE(h->enq_off));
+	int queue_full = !subenqueue(&sq->subq, val);
+	shm_rcu_unlock(q);
+	if (queue_full) {
+		/*
+		 * Every step is idempotent, so if a previous owner of the
+		 * lock died halfway through, we simply finish the job.
+		 */
+		shm_lock(&h->lock);
+		if (h->enq_off == shm_offset(q, sq)) {
+			if (!sq->next_off) {
+				u64 size = 2 * sq->subq.size;
+				assert(size <= h->max_size);
+				WRITE_ONCE(sq->next_off, shm_alloc_subqueue(q, size));
+			}
+			h->grow_off = h->enq_off;
+			WRITE_ONCE(h->enq_off, sq->next_off);
+		}
+		/*
+		 * Our sq may be long gone, only touch the one we know is
+		 * still around.  It can't be freed before this is set.
+		 */
+		if (h->grow_off) {
+			struct shm_subqueue *old = shm_ptr(q, h->grow_off);
+			if (!old->subq.rcu_dequeue_count) {
+				mb();
+				WRITE_ONCE(old->subq.rcu_dequeue_count, shm_rcu_register(h));
+			}
+			h->grow_off = 0;
+		}
+		shm_unlock(&h->lock);
+		goto retry;
+	}
+}
+
+/* returns 0 on empty queue, 1 on dequeue */
+int shm_dequeue(struct shm_queue *q, u64 *retval)
+{
+	struct shm_header *h = q->hdr;
+
+	shm_rcu_lock(q);
+	struct shm_subqueue *sq = shm_ptr(q, READ_ONCE(h->deq_off));
+	for (;;) {
+		if (subdequeue(&sq->subq, retval)) {
+			shm_rcu_unlock(q);
+			return 1;
+		}
+		/* Have all consumers forgotten about an old queue? */
+		if (READ_ONCE(h->freeq_off) && shm_rcu_safe(h, READ_ONCE(h->rcu_free_count))) {
+			shm_lock(&h->lock);
+			u64 off = h->freeq_off;
+			if (off && shm_rcu_safe(h, h->rcu_free_count)) {
+				struct shm_subqueue *old = shm_ptr(q, off);
+				/* a dead grower may have left it behind */
+				if (h->grow_off == off)
+					h->grow_off = 0;
+				madvise(old, shm_subqueue_bytes(old->subq.size), MADV_REMOVE);
+				h->freeq_off = 0;
+			}
+			shm_unlock(&h->lock);
+		}
+		/* Have all producers forgotten about this queue? */
+		u64 next_off = READ_ONCE(sq->next_off);
+		u64 rcu_dequeue_count = READ_ONCE(sq->subq.rcu_dequeue_count);
+		if (next_off && rcu_dequeue_count && !READ_ONCE(h->freeq_off)
+				&& shm_rcu_safe(h, rcu_dequeue_count)) {
+			shm_lock(&h->lock);
+			if (!h->freeq_off && h->deq_off == shm_offset(q, sq)) {
+				struct shm_subqueue *next = shm_ptr(q, next_off);
+				next->subq.ancestor_count = sq->subq.ancestor_count + sq->subq.tail;
+				WRITE_ONCE(h->deq_off, next_off);
+				h->rcu_free_count = shm_rcu_register(h);
+				/* dying before this merely leaks the old subqueue */
+				WRITE_ONCE(h->freeq_off, shm_offset(q, sq));
+			}
+			shm_unlock(&h->lock);
+		}
+		if (!next_off)
+			break;
+		sq = shm_ptr(q, next_off);
+	}
+	shm_rcu_unlock(q);
+	return 0;
+}
+
+#ifdef SHM_QUEUE_SELFTEST
+/*
+ *	gcc -O2 -mcx16 -DSHM_QUEUE_SELFTEST -pthread shm_queue.c -o shm_queue_selftest
+ *
+ * Forked producers and consumers open the queue by name, so every process
+ * maps it at a different address.  A tiny initial size forces lots of grows
+ * and frees.  Consumers check that each producer's entries arrive in order
+ * and exactly once.  Then a process gets killed while holding the grow lock
+ * inside an RCU critical section, and we have to grow, drain and release
+ * the old subqueues anyway.
+ */
+#include <signal.h>
+#include <sys/wait.h>
+
+#define TEST_PRODUCERS	4
+#define TEST_CONSUMERS	2
+#define TEST_N		(1ull<<18)
+#define TEST_SEQ_BITS	40
+
+struct test_shared {
+	u64 remaining;
+	u64 seen[TEST_PRODUCERS*TEST_N/64];
+};
+
+static char test_name[64];
+static struct test_shared *test;
+
+static void test_producer(u64 id)
+{
+	struct shm_queue *q = shm_queue_open(test_name);
+
+	assert(q);
+	for (u64 seq=0; seq<TEST_N; seq++)
+		shm_enqueue(q, id<<TEST_SEQ_BITS | seq);
+	shm_queue_close(q);
+}
+
+static void test_consumer(u64 id)
+{
+	struct shm_queue *q = shm_queue_open(test_name);
+	u64 last[TEST_PRODUCERS];
+	u64 val;
+
+	assert(q);
+	memset(last, 0xff, sizeof(last));
+	while (READ_ONCE(test->remaining)) {
+		if (!shm_dequeue(q, &val)) {
+			sched_yield();
+			continue;
+		}
+		atomic_dec(&test->remaining);
+		u64 pid = val >> TEST_SEQ_BITS;
+		u64 seq = val & ((1ull<<TEST_SEQ_BITS)-1);
+		if (pid >= TEST_PRODUCERS || seq >= TEST_N
+				|| (last[pid] != -1ull && seq <= last[pid])) {
+			fprintf(stderr, "producer %lld: %lld after %lld\n", pid, seq, last[pid]);
+			abort();
+		}
+		last[pid] = seq;
+		u64 bit = pid*TEST_N + seq;
+		if (__sync_fetch_and_or(&test->seen[bit/64], 1ull<<(bit%64)) & 1ull<<(bit%64)) {
+			fprintf(stderr, "producer %lld: %lld duplicate\n", pid, seq);
+			abort();
+		}
+	}
+	shm_queue_close(q);
+}
+
+static pid_t test_fork(void (*fn)(u64 id), u64 id)
+{
+	pid_t pid = fork();
+
+	assert(pid >= 0);
+	if (!pid) {
+		fn(id);
+		_exit(0);
+	}
+	return pid;
+}
+
+/* a failed child would leave the others waiting forever */
+static void test_wait(pid_t *pid, u64 n)
+{
+	int status;
+
+	for (u64 i=0; i<n; i++) {
+		pid_t child = wait(&status);
+		if (WIFEXITED(status) && !WEXITSTATUS(status))
+			continue;
+		fprintf(stderr, "child %d failed\n", child);
+		for (u64 j=0; j<n; j++)
+			kill(pid[j], SIGKILL);
+		abort();
+	}
+}
+
+static void test_ordering(struct shm_queue *q)
+{
+	pid_t pid[TEST_PRODUCERS + TEST_CONSUMERS];
+	u64 val;
+
+	test->remaining = TEST_PRODUCERS * TEST_N;
+	for (u64 i=0; i<TEST_CONSUMERS; i++)
+		pid[TEST_PRODUCERS+i] = test_fork(test_consumer, i);
+	for (u64 i=0; i<TEST_PRODUCERS; i++)
+		pid[i] = test_fork(test_producer, i);
+	test_wait(pid, ARRAY_SIZE(pid));
+	for (u64 i=0; i<ARRAY_SIZE(test->seen); i++) {
+		if (test->seen[i] != -1ull) {
+			fprintf(stderr, "lost entries around %lld\n", i*64);
+			abort();
+		}
+	}
+	if (shm_dequeue(q, &val)) {
+		fprintf(stderr, "queue not empty\n");
+		abort();
+	}
+	printf("%d producers, %d consumers, %lld entries, %lld bytes of subqueues: ok\n",
+			TEST_PRODUCERS, TEST_CONSUMERS, TEST_PRODUCERS * TEST_N,
+			q->hdr->file_size);
+}
+
+/* the child doesn't get to unlock or leave its critical section */
+static void test_die_locked(int fd)
+{
+	struct shm_queue *q = shm_queue_open(test_name);
+
+	assert(q);
+	shm_rcu_lock(q);
+	shm_lock(&q->hdr->lock);
+	ssize_t ret = write(fd, "x", 1);
+	assert(ret == 1);
+	pause();
+}
+
+static void test_dead_owner(struct shm_queue *q)
+{
+	struct shm_header *h = q->hdr;
+	int pipefd[2];
+	struct stat st;
+	u64 val, n;
+	char c;
+
+	int err = pipe(pipefd);
+	assert(!err);
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (!pid)
+		test_die_locked(pipefd[1]);
+	ssize_t ret = read(pipefd[0], &c, 1);
+	assert(ret == 1);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+
+	/* growing needs the lock, switching subqueues needs the dead reader gone */
+	u64 enq_off = h->enq_off;
+	for (n=0; h->enq_off == enq_off; n++)
+		shm_enqueue(q, n);
+	for (u64 i=0; i<n; i++) {
+		int ok = shm_dequeue(q, &val);
+		assert(ok && val == i);
+	}
+	for (int i=0; i<3 && (h->deq_off != h->enq_off || h->freeq_off); i++)
+		shm_dequeue(q, &val);
+	if (h->deq_off != h->enq_off || h->freeq_off) {
+		fprintf(stderr, "old subqueues never got freed\n");
+		abort();
+	}
+	/* everything but the header and the current subqueue was MADV_REMOVEd */
+	struct shm_subqueue *sq = shm_ptr(q, h->enq_off);
+	u64 live = ALIGN_UP(sizeof(*h), SHM_PAGE_SIZE) + shm_subqueue_bytes(sq->subq.size);
+	fstat(q->fd, &st);
+	if (st.st_blocks * 512 > live) {
+		fprintf(stderr, "%lld bytes in use, expected %lld\n", (u64)st.st_blocks * 512, live);
+		abort();
+	}
+	printf("lock owner killed in a critical section, %lld entries after: ok\n", n);
+}
+
+int main(void)
+{
+	snprintf(test_name, sizeof(test_name), "/shm_queue_selftest.%d", getpid());
+	test = mmap(NULL, sizeof(*test), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	assert(test != MAP_FAILED);
+	struct shm_queue *q = shm_queue_create(test_name, 2, 0);
+	assert(q);
+	test_ordering(q);
+	test_dead_owner(q);
+	shm_queue_close(q);
+	shm_unlink(test_name);
+	return 0;
+}
+#endif
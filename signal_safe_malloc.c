@@ -0,0 +1,1065 @@
+/*
+ * signal_safe_malloc - thread-caching malloc that is async-signal-safe
+ *
+ *	gcc -O2 -fno-omit-frame-pointer -shared -fPIC signal_safe_malloc.c -o ssmalloc.so
+ *	LD_PRELOAD=./ssmalloc.so ./your_program
+ *
+ * Or link it into your program.  See signal_safe_malloc.md for the why.
+ *
+ * Small allocations up to 256KiB come from spans holding objects of a single
+ * size class.  Sizes are rounded up to multiples of 16 bytes up to 128 bytes
+ * and to four classes per power of two above, which keeps internal
+ * fragmentation below 25%.  Spans are carved out of one big NORESERVE
+ * mapping in units of 64KiB, so free() recognizes our objects with a range
+ * check and finds their span through a side table.  No object headers.
+ * Larger allocations get their own mapping, with a header in front.
+ *
+ * Every thread has a cache of free objects per size class.  The fast path
+ * pops from or pushes to a singly linked list and never uses an atomic.  The
+ * cache is protected by trylock_unsafe(), which only guards against the same
+ * thread coming back through a signal handler.  A signal handler that finds
+ * the cache busy bypasses it and goes to the arenas directly.
+ *
+ * Caches refill from and flush to arenas in batches.  Each arena has a PI
+ * lock.  Allocation tries the thread's own arena, then all others, and only
+ * blocks if the thread doesn't hold an arena already.  A signal handler that
+ * interrupted an arena holder falls back to mmap instead.  Frees never
+ * block.  If the owning arena is locked, objects go on a lock-free deferred
+ * list that the next lock holder drains.  The lock for the global list of
+ * free spans is only ever trylocked, we bump-allocate fresh spans if it is
+ * busy.  So no matter where a signal hits, the handler can make progress.
+ *
+ * Spans get reused, but never returned to the kernel.  Large mappings up to
+ * 32MiB are rounded to the same four classes per power of two and kept in a
+ * 64MiB cache when freed, so the next allocation of that class skips mmap
+ * and the page faults.  Anything else is unmapped on free.  realloc() of
+ * large allocations uses mremap().
+ *
+ * ufence is built in.  Set UFENCE_MEM_LIMIT to sample allocations into
+ * ufence, the other UFENCE_* variables work as in ufence_preload.c.  We
+ * don't install a signal handler, call ufence_segfault(info->si_addr, uc)
+ * from your SA_SIGINFO handler.  The ufence slow path calls
+ * pthread_getattr_np() once per thread, which is the one place that isn't
+ * signal-safe.
+ */
+#define UFENCE_LIBRARY
+#include "ufence.c"
+#include <errno.h>
+
+#define UNIT_SHIFT	16
+#define UNIT_SIZE	(1ull<<UNIT_SHIFT)	/* 64KiB */
+#define MAX_HEAP	(1ull<<38)		/* 256GiB of address space */
+#define MIN_HEAP	(1ull<<30)		/*   1GiB */
+#define MAX_SMALL	(256<<10)
+#define NR_SIZE_CLASSES	52
+#define MIN_SPAN_OBJS	8
+#define MAX_SPAN_UNITS	32
+#define MAX_ARENAS	64
+#define TCACHE_BYTES	(64<<10)
+#define TCACHE_MIN	4
+#define TCACHE_MAX	256
+#define MALLOC_ALIGN	16
+#define LARGE_CACHE_MAX		(32<<20)	/* largest mapping we cache */
+#define LARGE_CACHE_BYTES	(64<<20)	/* all cached mappings together */
+#define NR_LARGE_BINS		28
+
+/* only declared with _GNU_SOURCE, which clashes with gettid() */
+void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...);
+#ifndef MREMAP_MAYMOVE
+#define MREMAP_MAYMOVE	1
+#endif
+
+/* size class for 1..MAX_SMALL bytes, 0 is treated as 1 */
+static inline u32 small_class(size_t size)
+{
+	if (size <= 128)
+		return size ? (size-1) >> 4 : 0;
+	u32 log = 63 - __builtin_clzll(size-1);
+	return 8 + (log-7)*4 + (((size-1) >> (log-2)) & 3);
+}
+
+static inline u64 class_size(u32 c)
+{
+	if (c < 8)
+		return (c+1) * 16;
+	u32 log = (c-8)/4 + 7;
+	return (u64)(4 + (c-8)%4 + 1) << (log-2);
+}
+
+static u32 class_units(u32 c)
+{
+	u64 units = ALIGN_UP(MIN_SPAN_OBJS * class_size(c), UNIT_SIZE) / UNIT_SIZE;
+	return units < MAX_SPAN_UNITS ? units : MAX_SPAN_UNITS;
+}
+
+/* objects a thread cache holds per class before flushing half of them */
+static inline u32 class_max(u32 c)
+{
+	u64 n = TCACHE_BYTES / class_size(c);
+	if (n < TCACHE_MIN)
+		return TCACHE_MIN;
+	return n < TCACHE_MAX ? n : TCACHE_MAX;
+}
+
+struct span {
+	void *free;		/* freed objects */
+	void *bump;		/* never handed out, up to end */
+	void *end;
+	struct span *next;	/* arena's partial list or free_spans */
+	struct span *prev;
+	u32 nr_used;
+	u32 units;
+	u32 class;
+	u32 arena;
+	u32 on_list;
+};
+
+/* Arena locks are PI locks, see ufence.c */
+struct arena {
+	struct lock_pi lock;
+	void *deferred;		/* objects freed while the lock was busy */
+	struct span *partial[NR_SIZE_CLASSES];
+} __attribute__((aligned(64)));
+
+static char *heap;
+static u64 heap_size;
+static u64 heap_used;
+static struct span *spans;	/* descriptor for a span starting at unit i */
+static u32 *unit_map;		/* first unit of the span unit i belongs to */
+static u32 init_state;
+static u32 nr_arenas = 1;
+static u32 next_arena;
+static struct arena arenas[MAX_ARENAS];
+static struct lock_pi span_lock;
+static struct span *free_spans[MAX_SPAN_UNITS+1];
+static pthread_key_t tcache_key;
+
+static inline int in_heap(void *p)
+{
+	return (u64)((char *)p - heap) < heap_size;
+}
+
+static inline struct span *span_of(void *p)
+{
+	return &spans[unit_map[((char *)p - heap) >> UNIT_SHIFT]];
+}
+
+static inline void *span_base(struct span *s)
+{
+	return heap + ((u64)(s - spans) << UNIT_SHIFT);
+}
+
+/* online CPUs without sysconf(), which may read /proc through stdio */
+static u32 nr_cpus(void)
+{
+	u64 mask[16] = {};
+	u32 n = 0;
+
+	if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) <= 0)
+		return 1;
+	for (u32 i=0; i<ARRAY_SIZE(mask); i++)
+		n += __builtin_popcountll(mask[i]);
+	return n ? n : 1;
+}
+
+static void tcache_destroy(void *arg);
+static void malloc_fork_prepare(void);
+static void malloc_fork_parent(void);
+static void malloc_fork_child(void);
+
+/*
+ * Reserve address space for the heap and its side tables.  NORESERVE
+ * mappings cost nothing until touched.  With strict overcommit they still
+ * count, so we retry with smaller sizes.  Nothing in here may call malloc,
+ * other threads spin until we are done.
+ */
+static void heap_init(void)
+{
+	u32 state = 0;
+
+	if (likely(__atomic_load_n(&init_state, __ATOMIC_ACQUIRE) == 2))
+		return;
+	if (!__atomic_compare_exchange_n(&init_state, &state, 1, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&init_state, __ATOMIC_ACQUIRE) != 2)
+			sched_yield();
+		return;
+	}
+	for (u64 size = MAX_HEAP; size >= MIN_HEAP; size /= 2) {
+		u64 units = size >> UNIT_SHIFT;
+		u64 meta = units * (sizeof(struct span) + sizeof(u32));
+		void *p = mmap(NULL, size + UNIT_SIZE + meta, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED)
+			continue;
+		heap = PTR_ALIGN_UP(p, UNIT_SIZE);
+		heap_size = size;
+		spans = (void *)(heap + size);
+		unit_map = (void *)(spans + units);
+		break;
+	}
+	assert(heap);
+	assert(small_class(LARGE_CACHE_MAX) - NR_SIZE_CLASSES < NR_LARGE_BINS);
+	u32 n = 2 * nr_cpus();
+	nr_arenas = n < MAX_ARENAS ? n : MAX_ARENAS;
+	pthread_key_create(&tcache_key, tcache_destroy);
+	__atomic_store_n(&init_state, 2, __ATOMIC_RELEASE);
+	/* may malloc */
+	pthread_atfork(malloc_fork_prepare, malloc_fork_parent, malloc_fork_child);
+}
+
+/* trylock only, so nobody ever waits for span_lock */
+static struct span *alloc_span(u32 units)
+{
+	struct span *s = NULL;
+
+	if (READ_ONCE(free_spans[units]) && trylock_pi(&span_lock)) {
+		s = free_spans[units];
+		if (s)
+			free_spans[units] = s->next;
+		unlock_pi(&span_lock);
+	}
+	if (s)
+		return s;
+	u64 bytes = (u64)units << UNIT_SHIFT;
+	u64 off = __sync_fetch_and_add(&heap_used, bytes);
+	if (off + bytes > heap_size)
+		return NULL;
+	u32 first = off >> UNIT_SHIFT;
+	s = &spans[first];
+	s->units = units;
+	for (u32 i=0; i<units; i++)
+		unit_map[first+i] = first;
+	return s;
+}
+
+static void span_link(struct arena *a, struct span *s)
+{
+	struct span **head = &a->partial[s->class];
+
+	s->prev = NULL;
+	s->next = *head;
+	if (s->next)
+		s->next->prev = s;
+	*head = s;
+	s->on_list = 1;
+}
+
+static void span_unlink(struct arena *a, struct span *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		a->partial[s->class] = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	s->on_list = 0;
+}
+
+static struct span *new_span(struct arena *a, u32 c)
+{
+	struct span *s = alloc_span(class_units(c));
+	if (!s)
+		return NULL;
+	u64 size = class_size(c);
+	s->free = NULL;
+	s->bump = span_base(s);
+	s->end = s->bump + ((u64)s->units << UNIT_SHIFT) / size * size;
+	s->nr_used = 0;
+	s->class = c;
+	s->arena = a - arenas;
+	span_link(a, s);
+	return s;
+}
+
+/* Empty spans go back to the global list, unless it is busy */
+static void release_span(struct arena *a, struct span *s)
+{
+	if (!trylock_pi(&span_lock))
+		return;
+	span_unlink(a, s);
+	s->next = free_spans[s->units];
+	free_spans[s->units] = s;
+	unlock_pi(&span_lock);
+}
+
+/* arena lock held */
+static void arena_put(struct arena *a, void *p)
+{
+	struct span *s = span_of(p);
+
+	*(void **)p = s->free;
+	s->free = p;
+	s->nr_used--;
+	if (!s->on_list)
+		span_link(a, s);
+	else if (!s->nr_used && (s->prev || s->next))
+		release_span(a, s); /* keep the last one around */
+}
+
+static void drain_deferred(struct arena *a)
+{
+	void *p = __atomic_exchange_n(&a->deferred, NULL, __ATOMIC_ACQUIRE);
+
+	while (p) {
+		void *next = *(void **)p;
+		arena_put(a, p);
+		p = next;
+	}
+}
+
+/* lock-free, tail points to the next pointer of the last object */
+static void push_deferred(struct arena *a, void *head, void **tail)
+{
+	void *old = READ_ONCE(a->deferred);
+
+	do {
+		*tail = old;
+	} while (!__atomic_compare_exchange_n(&a->deferred, &old, head, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Arenas the current thread holds.  Non-zero means we are in a signal
+ * handler that interrupted the holder.  Blocking then could deadlock
+ * against another handler waiting for our arena.
+ */
+static __thread u32 arenas_held __attribute__((tls_model("initial-exec")));
+
+/* count first, a signal right after taking the lock must see it */
+static int trylock_arena(struct arena *a)
+{
+	arenas_held++;
+	if (trylock_pi(&a->lock))
+		return 1;
+	arenas_held--;
+	return 0;
+}
+
+static void unlock_arena(struct arena *a)
+{
+	unlock_pi(&a->lock);
+	arenas_held--;
+}
+
+/*
+ * Try the preferred arena, then all others.  If all are busy, wait for
+ * one, unless we already hold an arena.  Holders never block, so waiters
+ * always make progress.  Returns NULL if we may not wait.
+ */
+static struct arena *lock_arena(u32 pref)
+{
+	for (u32 i=0; i<nr_arenas; i++) {
+		struct arena *a = &arenas[(pref + i) % nr_arenas];
+		if (trylock_arena(a))
+			return a;
+	}
+	if (arenas_held)
+		return NULL;
+	struct arena *a = &arenas[pref];
+	arenas_held++;
+	lock_pi(&a->lock);
+	return a;
+}
+
+/*
+ * Returns up to want objects of class c as a list.  NULL when out of memory
+ * or when all arenas are busy and we may not wait.
+ */
+static void *arena_alloc(u32 pref, u32 c, u32 want, u32 *got)
+{
+	struct arena *a = lock_arena(pref);
+	void *list = NULL;
+	u32 n = 0;
+
+	*got = 0;
+	if (!a)
+		return NULL;
+	drain_deferred(a);
+	while (n < want) {
+		struct span *s = a->partial[c];
+		if (!s) {
+			s = new_span(a, c);
+			if (!s)
+				break;
+		}
+		while (n < want) {
+			void *p = s->free;
+			if (p) {
+				s->free = *(void **)p;
+			} else if (s->bump < s->end) {
+				p = s->bump;
+				s->bump += class_size(c);
+			} else {
+				break;
+			}
+			*(void **)p = list;
+			list = p;
+			s->nr_used++;
+			n++;
+		}
+		if (!s->free && s->bump >= s->end)
+			span_unlink(a, s);
+	}
+	unlock_arena(a);
+	*got = n;
+	return list;
+}
+
+/* Return a list of objects to their arenas, never blocks */
+static void free_objects(void *list)
+{
+	while (list) {
+		struct arena *a = &arenas[span_of(list)->arena];
+		void *mine = NULL, **tail = &mine, *rest = NULL;
+
+		while (list) {
+			void *next = *(void **)list;
+			if (&arenas[span_of(list)->arena] == a) {
+				*tail = list;
+				tail = list;
+			} else {
+				*(void **)list = rest;
+				rest = list;
+			}
+			list = next;
+		}
+		*tail = NULL;
+		if (trylock_arena(a)) {
+			drain_deferred(a);
+			while (mine) {
+				void *next = *(void **)mine;
+				arena_put(a, mine);
+				mine = next;
+			}
+			unlock_arena(a);
+		} else {
+			push_deferred(a, mine, tail);
+		}
+		list = rest;
+	}
+}
+
+/* Use only for thread cache - doesn't protect against other CPUs/threads */
+struct lock {
+	int lock;
+};
+
+static inline int trylock_unsafe(struct lock *l)
+{
+	int ret = l->lock;
+	if (!l->lock) {
+		l->lock = 1;
+		__atomic_signal_fence(__ATOMIC_ACQUIRE);
+	}
+	return ret;
+}
+
+static inline void unlock_unsafe(struct lock *l)
+{
+	__atomic_signal_fence(__ATOMIC_RELEASE);
+	l->lock = 0;
+}
+
+#define TC_NEW		0
+#define TC_LIVE		1
+#define TC_DEAD		2	/* thread is exiting, bypass the cache */
+struct tcache {
+	struct lock lock;
+	u32 state;
+	u32 arena;
+	u32 count[NR_SIZE_CLASSES];
+	void *head[NR_SIZE_CLASSES];
+};
+
+static __thread struct tcache tcache __attribute__((tls_model("initial-exec")));
+
+static void tcache_init(struct tcache *tc)
+{
+	heap_init();
+	tc->arena = __sync_fetch_and_add(&next_arena, 1) % nr_arenas;
+	tc->state = TC_LIVE;
+	pthread_setspecific(tcache_key, tc);
+}
+
+/* thread exit, hand everything back */
+static void tcache_destroy(void *arg)
+{
+	struct tcache *tc = arg;
+
+	trylock_unsafe(&tc->lock);
+	tc->state = TC_DEAD;
+	for (u32 c=0; c<NR_SIZE_CLASSES; c++) {
+		free_objects(tc->head[c]);
+		tc->head[c] = NULL;
+		tc->count[c] = 0;
+	}
+	unlock_unsafe(&tc->lock);
+}
+
+static void *alloc_one(u32 pref, u32 c)
+{
+	u32 got;
+	heap_init();
+	return arena_alloc(pref, c, 1, &got);
+}
+
+static void free_one(void *p)
+{
+	*(void **)p = NULL;
+	free_objects(p);
+}
+
+/* cache lock held, cache for class c is empty */
+static void *tcache_refill(struct tcache *tc, u32 c)
+{
+	u32 got;
+
+	if (unlikely(tc->state != TC_LIVE)) {
+		if (tc->state == TC_DEAD)
+			return alloc_one(0, c);
+		tcache_init(tc);
+	}
+	void *p = arena_alloc(tc->arena, c, class_max(c)/2 + 1, &got);
+	if (!p)
+		return NULL;
+	tc->head[c] = *(void **)p;
+	tc->count[c] = got - 1;
+	return p;
+}
+
+/* cache lock held, hand half of class c back */
+static void tcache_flush(struct tcache *tc, u32 c)
+{
+	u32 keep = tc->count[c] / 2;
+	void *p = tc->head[c];
+
+	for (u32 i=1; i<keep; i++)
+		p = *(void **)p;
+	void *list = *(void **)p;
+	*(void **)p = NULL;
+	tc->count[c] = keep;
+	free_objects(list);
+}
+
+static inline void *small_alloc(u32 c)
+{
+	struct tcache *tc = &tcache;
+	void *p;
+
+	if (unlikely(trylock_unsafe(&tc->lock))) {
+		/* signal handler interrupted malloc or free on this thread */
+		return alloc_one(tc->arena, c);
+	}
+	p = tc->head[c];
+	if (likely(p)) {
+		tc->head[c] = *(void **)p;
+		tc->count[c]--;
+	} else {
+		p = tcache_refill(tc, c);
+	}
+	unlock_unsafe(&tc->lock);
+	return p;
+}
+
+static inline void small_free(void *p)
+{
+	struct tcache *tc = &tcache;
+
+	if (unlikely(trylock_unsafe(&tc->lock))) {
+		free_one(p);
+		return;
+	}
+	if (unlikely(tc->state != TC_LIVE)) {
+		if (tc->state == TC_DEAD) {
+			unlock_unsafe(&tc->lock);
+			free_one(p);
+			return;
+		}
+		tcache_init(tc);
+	}
+	u32 c = span_of(p)->class;
+	*(void **)p = tc->head[c];
+	tc->head[c] = p;
+	if (unlikely(++tc->count[c] > class_max(c)))
+		tcache_flush(tc, c);
+	unlock_unsafe(&tc->lock);
+}
+
+#define LARGE_MAGIC	0x6c61726765ull	/* "large" */
+struct large {
+	u64 magic;
+	void *base;
+	u64 len;
+	struct large *next;	/* in large_cache */
+};
+
+/*
+ * Freed mappings, one list per class.  trylock only, like span_lock, if
+ * someone holds it we simply mmap or munmap.
+ */
+static struct lock_pi large_lock;
+static u64 large_cached;
+static struct large *large_cache[NR_LARGE_BINS];
+
+/* mapping size for an allocation with the object one page in */
+static u64 large_len(size_t size)
+{
+	u64 len = ALIGN_UP(size, PAGE_SIZE) + PAGE_SIZE;
+	if (len <= LARGE_CACHE_MAX)
+		len = class_size(small_class(len));
+	return len;
+}
+
+static int large_bin(u64 len)
+{
+	if (len > LARGE_CACHE_MAX || class_size(small_class(len)) != len)
+		return -1;
+	return small_class(len) - NR_SIZE_CLASSES;
+}
+
+static struct large *large_cache_get(u64 len)
+{
+	int bin = large_bin(len);
+	struct large *l = NULL;
+
+	if (bin < 0 || !READ_ONCE(large_cache[bin]) || !trylock_pi(&large_lock))
+		return NULL;
+	l = large_cache[bin];
+	if (l) {
+		large_cache[bin] = l->next;
+		large_cached -= len;
+	}
+	unlock_pi(&large_lock);
+	return l;
+}
+
+static int large_cache_put(struct large *l)
+{
+	int bin = large_bin(l->len);
+
+	if (bin < 0 || READ_ONCE(large_cached) + l->len > LARGE_CACHE_BYTES
+			|| !trylock_pi(&large_lock))
+		return 0;
+	int ret = large_cached + l->len <= LARGE_CACHE_BYTES;
+	if (ret) {
+		l->next = large_cache[bin];
+		large_cache[bin] = l;
+		large_cached += l->len;
+	}
+	unlock_pi(&large_lock);
+	return ret;
+}
+
+/* Header right in front of the object, object page-aligned or better */
+static void *large_alloc(size_t size, size_t align, int zero)
+{
+	if (align < PAGE_SIZE)
+		align = PAGE_SIZE;
+	if (size > ADDRESS_SPACE || align > ADDRESS_SPACE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	u64 len;
+	if (align == PAGE_SIZE) {
+		len = large_len(size);
+		struct large *l = large_cache_get(len);
+		if (l) {
+			if (zero)
+				memset(l + 1, 0, size);
+			return l + 1;
+		}
+	} else {
+		len = ALIGN_UP(size, PAGE_SIZE) + align;
+	}
+	char *base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	char *p = PTR_ALIGN_UP(base + sizeof(struct large), align);
+	struct large *l = (struct large *)p - 1;
+	l->magic = LARGE_MAGIC;
+	l->base = base;
+	l->len = len;
+	return p;
+}
+
+static struct large *large_hdr(void *p)
+{
+	struct large *l = (struct large *)p - 1;
+	assert(l->magic == LARGE_MAGIC);
+	return l;
+}
+
+/* only objects one page into their mapping are cached or moved */
+static int large_movable(struct large *l)
+{
+	return (char *)(l + 1) == (char *)l->base + PAGE_SIZE;
+}
+
+static void large_free(void *p)
+{
+	struct large *l = large_hdr(p);
+	if (!large_movable(l) || !large_cache_put(l))
+		munmap(l->base, l->len);
+}
+
+/* NULL if we can't, the caller copies instead */
+static void *large_realloc(void *p, size_t size)
+{
+	struct large *l = large_hdr(p);
+
+	if (!large_movable(l) || size > ADDRESS_SPACE)
+		return NULL;
+	u64 len = large_len(size);
+	char *base = mremap(l->base, l->len, len, MREMAP_MAYMOVE);
+	if (base == MAP_FAILED)
+		return NULL;
+	l = (struct large *)(base + PAGE_SIZE) - 1;
+	l->base = base;
+	l->len = len;
+	return l + 1;
+}
+
+/*
+ * GCC knows what malloc() and friends do and happily turns malloc+memset
+ * into a call to calloc(), which would recurse.  Internal callers use these.
+ */
+static void *do_malloc(size_t size, int zero)
+{
+	void *p;
+
+	if (unlikely(ufence_hmap)) {
+		/* fresh mapping, already zeroed */
+		p = ufence_malloc(ALIGN_UP(size, MALLOC_ALIGN));
+		if (p)
+			return p;
+	}
+	if (unlikely(size > MAX_SMALL))
+		return large_alloc(size, PAGE_SIZE, zero);
+	p = small_alloc(small_class(size));
+	if (unlikely(!p))
+		return large_alloc(size, PAGE_SIZE, zero); /* heap exhausted or arenas busy */
+	if (zero)
+		memset(p, 0, size);
+	return p;
+}
+
+static void do_free(void *p)
+{
+	if (likely(in_heap(p))) {
+		small_free(p);
+		return;
+	}
+	if (!p)
+		return;
+	if (ufence_find(p)) {
+		ufence_free(p);
+		return;
+	}
+	large_free(p);
+}
+
+void *malloc(size_t size)
+{
+	return do_malloc(size, 0);
+}
+
+void free(void *p)
+{
+	do_free(p);
+}
+
+size_t malloc_usable_size(void *p)
+{
+	if (in_heap(p))
+		return class_size(span_of(p)->class);
+	if (!p)
+		return 0;
+	struct mapping *m = ufence_find(p);
+	if (m)
+		return m->size;
+	struct large *l = large_hdr(p);
+	return (char *)l->base + l->len - (char *)p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return do_malloc(total, 1);
+}
+
+void *realloc(void *p, size_t size)
+{
+	if (!p)
+		return do_malloc(size, 0);
+	if (!size) {
+		do_free(p);
+		return NULL;
+	}
+	size_t old = malloc_usable_size(p);
+	if (size <= old && size > old/2)
+		return p;
+	void *new;
+	if (size > MAX_SMALL && !in_heap(p) && !ufence_find(p)) {
+		new = large_realloc(p, size);
+		if (new)
+			return new;
+	}
+	new = do_malloc(size, 0);
+	if (!new)
+		return NULL;
+	memcpy(new, p, old < size ? old : size);
+	do_free(p);
+	return new;
+}
+
+void *reallocarray(void *p, size_t nmemb, size_t size)
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(p, total);
+}
+
+/*
+ * Spans are 64KiB-aligned, so objects in a class whose size is a multiple
+ * of the alignment are aligned.  Anything else goes to mmap.
+ */
+void *memalign(size_t align, size_t size)
+{
+	void *p;
+
+	if (align & (align-1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (align <= MALLOC_ALIGN)
+		return do_malloc(size, 0);
+	if (unlikely(ufence_hmap)) {
+		p = ufence_memalign(align, size);
+		if (p)
+			return p;
+	}
+	if (size <= MAX_SMALL && align <= MAX_SMALL) {
+		u32 c = small_class(size > align ? size : align);
+		while (c < NR_SIZE_CLASSES && class_size(c) % align)
+			c++;
+		if (c < NR_SIZE_CLASSES) {
+			p = small_alloc(c);
+			if (p)
+				return p;
+		}
+	}
+	return large_alloc(size, align, 0);
+}
+
+int posix_memalign(void **pp, size_t align, size_t size)
+{
+	if (align < sizeof(void *) || align & (align-1))
+		return EINVAL;
+	void *p = memalign(align, size);
+	if (!p)
+		return ENOMEM;
+	*pp = p;
+	return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+void *valloc(size_t size)
+{
+	return memalign(PAGE_SIZE, size);
+}
+
+void *pvalloc(size_t size)
+{
+	return memalign(PAGE_SIZE, ALIGN_UP(size, PAGE_SIZE));
+}
+
+/*
+ * We hold every arena until the fork is done.  A signal handler running in
+ * between must know, or it would wait for an arena we hold ourselves.
+ */
+static void malloc_fork_prepare(void)
+{
+	arenas_held += nr_arenas;
+	for (u32 i=0; i<nr_arenas; i++)
+		lock_pi(&arenas[i].lock);
+	lock_pi(&span_lock);
+	lock_pi(&large_lock);
+}
+
+static void malloc_fork_parent(void)
+{
+	unlock_pi(&large_lock);
+	unlock_pi(&span_lock);
+	for (u32 i=0; i<nr_arenas; i++)
+		unlock_pi(&arenas[i].lock);
+	arenas_held -= nr_arenas;
+}
+
+/* PI locks contain the owner's tid, which is different in the child */
+static void malloc_fork_child(void)
+{
+	large_lock.lock = 0;
+	span_lock.lock = 0;
+	for (u32 i=0; i<nr_arenas; i++)
+		arenas[i].lock.lock = 0;
+	arenas_held -= nr_arenas;
+}
+
+static u64 env_u64(const char *name, u64 def)
+{
+	const char *s = getenv(name);
+	return s && *s ? strtoull(s, NULL, 0) : def;
+}
+
+__attribute__((constructor))
+static void malloc_init(void)
+{
+	heap_init();
+	u64 mem_limit = env_u64("UFENCE_MEM_LIMIT", 0);
+	if (!mem_limit)
+		return;
+	ufence_set_sample_interval(env_u64("UFENCE_SAMPLE_INTERVAL", DEFAULT_SAMPLE_INTERVAL));
+	if (env_u64("UFENCE_POOL", 0))
+		ufence_init_pool(mem_limit);
+	else
+		ufence_init(mem_limit);
+	const char *path = getenv("UFENCE_CONFIG");
+	if (path && *path)
+		ufence_set_config_file(path);
+	path = getenv("UFENCE_STATS");
+	if (path && *path)
+		ufence_set_stats_file(path);
+}
+
+#ifdef MALLOC_SELFTEST
+/*
+ * The signal-safety test from signal_safe_malloc.md.  Threads hammer
+ * malloc and free while the main thread keeps sending them signals, and the
+ * signal handler calls malloc and free as well.  A deadlock trips alarm(),
+ * anything else going wrong crashes.
+ *
+ *	gcc -O2 -DMALLOC_SELFTEST -pthread signal_safe_malloc.c -o malloc_selftest
+ *	./malloc_selftest
+ */
+#define TEST_THREADS	16
+#define TEST_SLOTS	256
+#define TEST_SECONDS	5
+
+static int test_stop;
+static u64 test_ops;
+
+/* mostly small, some medium, a few large */
+static size_t test_size(void)
+{
+	u64 r = rand_n(100);
+	if (r < 90)
+		return rand_n(1024);
+	if (r < 99)
+		return rand_n(64<<10);
+	return rand_n(1<<20);
+}
+
+/* everything we hand out gets dirtied, so reused memory is never zero */
+static void test_check(char *p, size_t size, char c)
+{
+	for (size_t i=0; i<size; i++)
+		if (p[i] != c)
+			abort();
+}
+
+static void *test_alloc(size_t size)
+{
+	void *p;
+
+	switch (rand_n(8)) {
+	case 0:
+		p = calloc(1, size);
+		test_check(p, size, 0);
+		return p;
+	case 1:
+		return memalign(64 << rand_n(7), size);
+	default:
+		return malloc(size);
+	}
+}
+
+static void test_handler(int sig)
+{
+	void *p[4];
+
+	for (u32 i=0; i<ARRAY_SIZE(p); i++) {
+		size_t size = test_size();
+		p[i] = test_alloc(size);
+		memset(p[i], 0x5a, size);
+	}
+	for (u32 i=0; i<ARRAY_SIZE(p); i++)
+		free(p[i]);
+}
+
+static void *test_thread(void *arg)
+{
+	void *slot[TEST_SLOTS] = {};
+	size_t slot_size[TEST_SLOTS] = {};
+	u64 ops = 0;
+
+	while (!READ_ONCE(test_stop)) {
+		u32 i = rand_n(TEST_SLOTS);
+		size_t size = test_size();
+		if (slot[i] && rand_n(4)) {
+			free(slot[i]);
+			slot[i] = test_alloc(size);
+		} else {
+			slot[i] = realloc(slot[i], size);
+			test_check(slot[i], size < slot_size[i] ? size : slot_size[i], 0xa5);
+		}
+		memset(slot[i], 0xa5, size);
+		slot_size[i] = size;
+		ops++;
+	}
+	for (u32 i=0; i<TEST_SLOTS; i++)
+		free(slot[i]);
+	__sync_fetch_and_add(&test_ops, ops);
+	return NULL;
+}
+
+int main(void)
+{
+	struct sigaction act = { .sa_handler = test_handler, .sa_flags = SA_RESTART };
+	struct timespec ts = { .tv_nsec = 10000 };
+	pthread_t tid[TEST_THREADS];
+	u64 signals = 0;
+
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGUSR1, &act, NULL);
+	alarm(4 * TEST_SECONDS);
+	for (int i=0; i<TEST_THREADS; i++)
+		pthread_create(&tid[i], NULL, test_thread, NULL);
+	u64 end = get_monotonic() + TEST_SECONDS * 1000000000ull;
+	while (get_monotonic() < end) {
+		pthread_kill(tid[rand_n(TEST_THREADS)], SIGUSR1);
+		signals++;
+		nanosleep(&ts, NULL);
+	}
+	WRITE_ONCE(test_stop, 1);
+	for (int i=0; i<TEST_THREADS; i++)
+		pthread_join(tid[i], NULL);
+	printf("%d threads, %lld ops, %lld signals: ok\n", TEST_THREADS, test_ops, signals);
+	return 0;
+}
+#endif
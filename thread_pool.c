@@ -0,0 +1,413 @@
+/*
+ * Work-stealing thread pool.
+ *
+ * Every worker has its own Chase-Lev deque.  The owner pushes and pops at
+ * the bottom without any locked instructions in the common case, thieves
+ * steal from the top with a cmpxchg.  Tasks submitted from outside the pool
+ * go to a global atomic_queue instead.  Idle workers look at their own
+ * deque, then the global queue, then try to steal from everyone else.  If
+ * all of that fails, they park on a futex.  Producers only issue a
+ * FUTEX_WAKE if someone is actually parked, same as dequeue_wait().
+ *
+ * Tasks are grouped.  task_group_wait() runs other tasks while waiting for
+ * its own, so nested parallelism doesn't deadlock even if every worker is
+ * waiting for some group.
+ *
+ *	struct thread_pool *pool = alloc_thread_pool(0);
+ *	parallel_for(pool, 0, n, 4096, fn, arg);
+ *	free_thread_pool(pool);
+ *
+ * Deque arrays only ever grow.  Thieves may still be reading an old array
+ * after the owner switched to a new one, so old arrays are kept around until
+ * the pool is freed.  That wastes at most as much memory as is in use.
+ */
+#include <limits.h>
+#include "atomic_queue.c"
+
+struct task_group {
+	struct thread_pool *pool;
+	unsigned pending;
+	unsigned done;	/* written last by whoever finished the last task */
+};
+
+struct task {
+	void (*fn)(void *arg);
+	void *arg;
+	struct task_group *group;
+};
+
+struct deque_array {
+	s64 size;
+	struct deque_array *prev; /* retired arrays, freed with the pool */
+	struct task *buf[];
+};
+
+struct worker {
+	/* owner-owned */
+	s64 bottom CL_ALIGNED;
+	struct deque_array *array;
+	/* thieves */
+	s64 top CL_ALIGNED;
+	/* static */
+	struct thread_pool *pool CL_ALIGNED;
+	pthread_t tid;
+	u64 rand;
+};
+
+struct thread_pool {
+	int nr_workers;
+	int stop;
+	struct atomic_queue *inject;
+	struct worker *workers;
+	/* parked workers */
+	unsigned sleepers CL_ALIGNED;
+	unsigned wakeups;
+};
+
+static __thread struct worker *local_worker;
+
+static struct deque_array *alloc_deque_array(s64 size, struct deque_array *prev)
+{
+	struct deque_array *a = malloc(sizeof(*a) + size*sizeof(a->buf[0]));
+	a->size = size;
+	a->prev = prev;
+	return a;
+}
+
+/* owner only */
+static void deque_push(struct worker *w, struct task *t)
+{
+	s64 b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+	s64 top = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	struct deque_array *a = w->array;
+
+	if (b - top > a->size - 1) {
+		struct deque_array *new = alloc_deque_array(2 * a->size, a);
+		for (s64 i=top; i<b; i++)
+			new->buf[i & (new->size-1)] = a->buf[i & (a->size-1)];
+		__atomic_store_n(&w->array, new, __ATOMIC_RELEASE);
+		a = new;
+	}
+	__atomic_store_n(&a->buf[b & (a->size-1)], t, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&w->bottom, b+1, __ATOMIC_RELAXED);
+}
+
+/* owner only, returns NULL on empty deque */
+static struct task *deque_pop(struct worker *w)
+{
+	s64 b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	struct deque_array *a = w->array;
+	struct task *t = NULL;
+
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	s64 top = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+	if (top <= b) {
+		t = __atomic_load_n(&a->buf[b & (a->size-1)], __ATOMIC_RELAXED);
+		if (top == b) {
+			/* last entry, race against thieves */
+			if (!__atomic_compare_exchange_n(&w->top, &top, top+1, 0,
+						__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				t = NULL;
+			__atomic_store_n(&w->bottom, b+1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&w->bottom, b+1, __ATOMIC_RELAXED);
+	}
+	return t;
+}
+
+/* anyone, returns NULL on empty deque or lost race */
+static struct task *deque_steal(struct worker *w)
+{
+	s64 top = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	s64 b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+
+	if (top >= b)
+		return NULL;
+	struct deque_array *a = __atomic_load_n(&w->array, __ATOMIC_ACQUIRE);
+	struct task *t = __atomic_load_n(&a->buf[top & (a->size-1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&w->top, &top, top+1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return t;
+}
+
+/* xorshift, good enough to pick a victim */
+static u32 pick_victim(struct worker *w, u32 n)
+{
+	w->rand ^= w->rand << 13;
+	w->rand ^= w->rand >> 7;
+	w->rand ^= w->rand << 17;
+	return ((u128)w->rand * n) >> 64;
+}
+
+static struct task *find_task(struct thread_pool *pool, struct worker *self)
+{
+	struct task *t;
+	u64 val;
+
+	if (self) {
+		t = deque_pop(self);
+		if (t)
+			return t;
+	}
+	if (dequeue(pool->inject, &val))
+		return (struct task *)val;
+	u32 n = pool->nr_workers;
+	u32 start = self ? pick_victim(self, n) : 0;
+	for (u32 i=0; i<n; i++) {
+		struct worker *victim = &pool->workers[(start + i) % n];
+		if (victim == self)
+			continue;
+		t = deque_steal(victim);
+		if (t)
+			return t;
+	}
+	return NULL;
+}
+
+static void run_task(struct task *t)
+{
+	struct task_group *g = t->group;
+
+	t->fn(t->arg);
+	free(t);
+	if (atomic_dec(&g->pending) == 1) {
+		/*
+		 * The group usually lives on the waiter's stack.  It can't
+		 * return before seeing done, so that is the last thing we touch.
+		 */
+		futex(&g->pending, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+		__atomic_store_n(&g->done, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* Wake a parked worker, if any.  Callers must have published their task. */
+static void wake_worker(struct thread_pool *pool)
+{
+	/* pairs with the atomic_inc(&pool->sleepers) in worker_park() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (READ_ONCE(pool->sleepers)) {
+		atomic_inc(&pool->wakeups);
+		futex(&pool->wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+static void worker_park(struct thread_pool *pool, struct worker *self)
+{
+	unsigned wakeups = READ_ONCE(pool->wakeups);
+	atomic_inc(&pool->sleepers);
+	struct task *t = find_task(pool, self);
+	if (!t && !READ_ONCE(pool->stop))
+		futex(&pool->wakeups, FUTEX_WAIT_PRIVATE, wakeups, NULL, NULL, 0);
+	atomic_dec(&pool->sleepers);
+	if (t)
+		run_task(t);
+}
+
+#define WORKER_SPINS	100
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	struct thread_pool *pool = w->pool;
+
+	local_worker = w;
+	while (!READ_ONCE(pool->stop)) {
+		struct task *t = NULL;
+		for (int i=0; i<WORKER_SPINS && !t; i++) {
+			t = find_task(pool, w);
+			if (!t)
+				cpu_relax();
+		}
+		if (t)
+			run_task(t);
+		else
+			worker_park(pool, w);
+	}
+	return NULL;
+}
+
+/* nr_workers defaults to the number of online CPUs */
+struct thread_pool *alloc_thread_pool(int nr_workers)
+{
+	if (!nr_workers)
+		nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	struct thread_pool *pool = aligned_alloc(64, sizeof(*pool));
+	memset(pool, 0, sizeof(*pool));
+	pool->nr_workers = nr_workers;
+	pool->inject = alloc_queue(0, 0);
+	pool->workers = aligned_alloc(64, nr_workers * sizeof(struct worker));
+	memset(pool->workers, 0, nr_workers * sizeof(struct worker));
+	for (int i=0; i<nr_workers; i++) {
+		struct worker *w = &pool->workers[i];
+		w->pool = pool;
+		w->array = alloc_deque_array(256, NULL);
+		w->rand = 0x9e3779b97f4a7c15ull * (i+1);
+	}
+	for (int i=0; i<nr_workers; i++)
+		pthread_create(&pool->workers[i].tid, NULL, worker_fn, &pool->workers[i]);
+	return pool;
+}
+
+/* Waits for the workers to exit.  All task groups must be done. */
+void free_thread_pool(struct thread_pool *pool)
+{
+	WRITE_ONCE(pool->stop, 1);
+	atomic_inc(&pool->wakeups);
+	futex(&pool->wakeups, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	for (int i=0; i<pool->nr_workers; i++) {
+		struct worker *w = &pool->workers[i];
+		pthread_join(w->tid, NULL);
+		struct deque_array *a = w->array;
+		while (a) {
+			struct deque_array *prev = a->prev;
+			free(a);
+			a = prev;
+		}
+	}
+	free_queue(pool->inject);
+	free(pool->workers);
+	free(pool);
+}
+
+void task_group_init(struct task_group *g, struct thread_pool *pool)
+{
+	g->pool = pool;
+	g->pending = 0;
+	g->done = 1;
+}
+
+void task_spawn(struct task_group *g, void (*fn)(void *arg), void *arg)
+{
+	struct thread_pool *pool = g->pool;
+	struct task *t = malloc(sizeof(*t));
+
+	t->fn = fn;
+	t->arg = arg;
+	t->group = g;
+	/* nothing of ours is in flight, so nobody else writes done */
+	if (!atomic_inc(&g->pending))
+		WRITE_ONCE(g->done, 0);
+	if (local_worker && local_worker->pool == pool)
+		deque_push(local_worker, t);
+	else
+		enqueue(pool->inject, (u64)t);
+	wake_worker(pool);
+}
+
+/* Runs tasks until every task in the group has finished */
+void task_group_wait(struct task_group *g)
+{
+	struct thread_pool *pool = g->pool;
+	struct worker *self = local_worker && local_worker->pool == pool ? local_worker : NULL;
+
+	for (;;) {
+		unsigned pending = READ_ONCE(g->pending);
+		if (!pending) {
+			while (!__atomic_load_n(&g->done, __ATOMIC_ACQUIRE))
+				cpu_relax();
+			return;
+		}
+		struct task *t = find_task(pool, self);
+		if (t) {
+			run_task(t);
+			continue;
+		}
+		/*
+		 * Nothing to help with, so all our tasks are running
+		 * somewhere.  The last one to finish wakes us up.
+		 */
+		futex(&g->pending, FUTEX_WAIT_PRIVATE, pending, NULL, NULL, 0);
+	}
+}
+
+struct parallel_for_chunk {
+	void (*fn)(void *arg, u64 begin, u64 end);
+	void *arg;
+	u64 begin;
+	u64 end;
+};
+
+static void parallel_for_task(void *arg)
+{
+	struct parallel_for_chunk *c = arg;
+	c->fn(c->arg, c->begin, c->end);
+}
+
+/*
+ * Calls fn(arg, begin, end) for chunks of up to grain iterations covering
+ * [begin, end) in parallel and returns when all of them are done.
+ */
+void parallel_for(struct thread_pool *pool, u64 begin, u64 end, u64 grain,
+		void (*fn)(void *arg, u64 begin, u64 end), void *arg)
+{
+	struct task_group g;
+
+	if (!grain)
+		grain = 1;
+	u64 n = (end - begin + grain - 1) / grain;
+	struct parallel_for_chunk *chunks = malloc(n * sizeof(*chunks));
+	task_group_init(&g, pool);
+	for (u64 i=0; i<n; i++) {
+		struct parallel_for_chunk *c = &chunks[i];
+		c->fn = fn;
+		c->arg = arg;
+		c->begin = begin + i*grain;
+		c->end = c->begin + grain < end ? c->begin + grain : end;
+		task_spawn(&g, parallel_for_task, c);
+	}
+	task_group_wait(&g);
+	free(chunks);
+}
+
+#ifdef THREAD_POOL_SELFTEST
+/*
+ *	gcc -O2 -mcx16 -DTHREAD_POOL_SELFTEST -pthread thread_pool.c -o thread_pool_selftest
+ *
+ * Sums a range with nested parallel_for() calls and many short-lived task
+ * groups on the stack, which is where a late wakeup would hit a dead frame.
+ */
+#define TEST_N		(1ull<<22)
+#define TEST_ROUNDS	1000
+
+static struct thread_pool *test_pool;
+static u64 test_sum;
+
+static void test_leaf(void *arg, u64 begin, u64 end)
+{
+	u64 sum = 0;
+
+	for (u64 i=begin; i<end; i++)
+		sum += i;
+	__sync_fetch_and_add(&test_sum, sum);
+}
+
+static void test_outer(void *arg, u64 begin, u64 end)
+{
+	parallel_for(test_pool, begin, end, 4096, test_leaf, NULL);
+}
+
+static void test_nop(void *arg)
+{
+}
+
+int main(void)
+{
+	test_pool = alloc_thread_pool(0);
+	parallel_for(test_pool, 0, TEST_N, TEST_N/16, test_outer, NULL);
+	assert(test_sum == TEST_N * (TEST_N-1) / 2);
+	for (int i=0; i<TEST_ROUNDS; i++) {
+		struct task_group g;
+		task_group_init(&g, test_pool);
+		for (int j=0; j<4; j++)
+			task_spawn(&g, test_nop, NULL);
+		task_group_wait(&g);
+	}
+	printf("%d workers: ok\n", test_pool->nr_workers);
+	free_thread_pool(test_pool);
+	return 0;
+}
+#endif
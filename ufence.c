@@ -10,8 +10,13 @@
  *
  * The entire allocation including guard pages has to fall within a single
  * 16MiB-aligned region to allow quick lookup for any associated address.
- * Large allocations up to 6MiB and aligned allocations up to 8MiB alignment
- * are supported, anything larger is not (without code changes).
+ *
+ * Larger allocations use larger regions.  Size class c has regions of
+ * 16MiB << 2c, allocations up to half a region minus the guard and aligned
+ * allocations up to half a region.  Each class owns 32TiB of the address
+ * space and has its own htable, so the address alone tells us which htable
+ * to probe.  Three classes cover allocations up to 126MiB.  Guard pages stay
+ * at 2MiB for every class.
  *
  * Allocations don't that fully occupy pages randomly get aligned to the
  * beginning or end of the allocation, with the obvious exception of memalign.
@@ -19,13 +24,21 @@
  * Freed memory is kept it in quarantine for a minute.  After that it will
  * eventually get reused.
  *
+ * Syscalls that change the page tables (mprotect, munmap) cause TLB shootdown
+ * IPIs to every core running one of our threads.  We don't want that on the
+ * allocating or freeing thread, so a background reaper does them.  Freed
+ * objects go into a FIFO, the reaper protects them in batches every
+ * REAPER_NS and unmaps them once their quarantine has expired.  Allocation
+ * only picks slots the reaper has already cleaned up.  The price is that a
+ * use-after-free within the first REAPER_NS goes unnoticed.
+ *
  * Allocations have several backoff mechanism.  We randomly select a slot to
- * use.  If the slot is currently in use or still in quarantine, we return
- * NULL.  We also return NULL if a random number plus currently used memory
- * exceeds our quota.  Both of those mechanisms combined create a quadratic
- * backoff mechanism, so ufence allocations become less frequent as the quota
- * gets used up.  But we avoid a hard transition between frequent allocations
- * and no allocations at all.
+ * use.  If the slot is currently in use, still in quarantine or another
+ * thread holds the lock for its shard, we return NULL.  We also return NULL
+ * if a random number plus currently used memory exceeds our quota.  Both of
+ * those mechanisms combined create a quadratic backoff mechanism, so ufence
+ * allocations become less frequent as the quota gets used up.  But we avoid
+ * a hard transition between frequent allocations and no allocations at all.
  *
  *
  * To make ufence useful, you have to integrate five functions into an
@@ -36,24 +49,42 @@
  * - ufence_init()
  * - ufence_segfault()
  *
- * Call ufence_malloc() from your regular allocator.  Avoid calling it from
- * the hot path, ufence_malloc() is slower than any regular allocator should
- * be.  One call every millisecond or so might be a good choice.  The same
- * goes for ufence_memalign().
+ * Call ufence_malloc() from your regular allocator on every allocation and
+ * fall back to the regular path when it returns NULL.  A per-thread
+ * countdown decides whether to sample an allocation, which costs a decrement
+ * and a branch.  Only sampled allocations enter the slow path, on average one
+ * in ufence_sample_interval.  Interval lengths are random (geometric), so
+ * programs with regular allocation patterns don't always sample the same
+ * call site.  The same goes for ufence_memalign().
  *
  * You have to mark ufence allocations in some way that allows to to call
  * ufence_free() whenever regular free() comes across a ufence object.  With
  * a dlmalloc-derived allocator, adding a header to the allocation will work,
- * but might hide buffer-underrun bugs from you.
+ * but might hide buffer-underrun bugs from you.  Alternatively ufence_find()
+ * recognizes ufence objects with a single hashtable lookup.  If it doesn't,
+ * ufence_double_free() tells you whether p is a ufence object that was
+ * already freed, and reports it.
  *
- * Call ufence_init() once to configure a fixed memory limit.  Ufence will
- * stay within that limit and slow down allocation frequence when you get
- * close.  There is currently no mechanism to change the limit at runtime.
+ * Or don't touch your allocator at all and use ufence_preload.c, which wraps
+ * whatever malloc the program uses and installs the signal handler.
+ *
+ * Call ufence_init() once to configure a memory limit.  Ufence will stay
+ * within that limit and slow down allocation frequence when you get close.
+ * ufence_set_mem_limit() and ufence_set_sample_interval() change the limits
+ * at runtime, ufence_get_stats() tells you how often ufence sampled and why
+ * it backed off.  ufence_set_config_file() and ufence_set_stats_file() do
+ * the same through files, for when you can't change the program.
  *
  * Finally, ufence turns memory corruption bugs in your code into segmentation
  * faults.  To get useful debug information, call ufence_segfault() from your
- * signal handler.  If the faulting address matches a ufence object, backtraces
- * for the allocation, free and fault get written to stderr.
+ * SA_SIGINFO signal handler and pass the ucontext along.  If the faulting
+ * address matches a ufence object, backtraces for the allocation, free and
+ * fault get written to stderr.  Reporting is async-signal-safe.  Backtraces are raw addresses with module offsets, feed
+ * them to addr2line or similar to get symbols.
+ *
+ * Backtraces are collected by following frame pointers, which is cheap but
+ * needs everything of interest compiled with -fno-omit-frame-pointer.
+ * Stacks stop at the first function without a frame pointer.
  *
  *
  * You can compile and run this binary to get a general idea.  The main()
@@ -62,27 +93,42 @@
  */
 
 #include <assert.h>
-#include <execinfo.h>
+#include <fcntl.h>
 #include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/random.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <time.h>
+#include <ucontext.h>
 #include <unistd.h>
 
 typedef unsigned __int128 u128;
 typedef unsigned long long u64;
+typedef long long s64;
 typedef unsigned u32;
 
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+
 #define ALIGN_DOWN(x, a)	((x) & ~((a)-1))
 #define ALIGN_UP(x, a)		ALIGN_DOWN((x)+(a)-1, a)
 #define PTR_ALIGN_DOWN(x, a)	((void *)ALIGN_DOWN((unsigned long)x, a))
 #define PTR_ALIGN_UP(x, a)	((void *)ALIGN_UP((unsigned long)x, a))
 
 #define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define READ_ONCE(x)		(*(const volatile __typeof(x) *)&(x))
+/* not a volatile cast, that trips -Wcast-qual for pointers to const */
+#define WRITE_ONCE(x, val)						\
+do {									\
+	__atomic_store_n(&(x), (val), __ATOMIC_RELAXED);		\
+} while (0)
 
 struct lock_pi {
 	unsigned lock;
@@ -137,11 +183,45 @@ static void unlock_pi(struct lock_pi *l)
 #define HARD_LIMIT	(0x40000000)		/*  1GiB */
 #define REGION_SIZE	( 0x1000000)		/* 16MiB */
 #define GUARD_SIZE	(  0x200000)		/*  2MiB */
-#define MAX_ALIGN	(REGION_SIZE/2)		/*  8MiB */
-#define MAX_ALLOC	(MAX_ALIGN-GUARD_SIZE)	/*  6MiB */
 #define PAGE_SIZE	(    0x1000)		/*  4kiB (amd64) */
 #define ADDRESS_SPACE	(1ull<<47)		/* 47bit (amd64) */
-#define ADDR_MASK	(ADDRESS_SPACE-REGION_SIZE)
+#define NR_CLASSES	3			/* 16MiB, 64MiB, 256MiB regions */
+#define CLASS_SHIFT	45
+#define CLASS_SPACE	(1ull<<CLASS_SHIFT)	/* 32TiB per class */
+
+static inline u32 addr_class(u64 addr)
+{
+	return addr >> CLASS_SHIFT;
+}
+
+static inline u64 class_base(u32 c)
+{
+	return (u64)c << CLASS_SHIFT;
+}
+
+static inline u64 region_size(u32 c)
+{
+	return (u64)REGION_SIZE << 2*c;
+}
+
+static inline u64 max_align(u32 c)
+{
+	return region_size(c) / 2;
+}
+
+static inline u64 max_alloc(u32 c)
+{
+	return max_align(c) - GUARD_SIZE;
+}
+
+/* smallest class that fits, NR_CLASSES if none does */
+static u32 size_class(size_t size, size_t alignment)
+{
+	u32 c = 0;
+	while (c < NR_CLASSES && (size > max_alloc(c) || alignment > max_align(c)))
+		c++;
+	return c;
+}
 
 static inline void *guard_alloc(size_t size, u64 addr)
 {
@@ -153,9 +233,13 @@ static inline void *guard_alloc(size_t size, u64 addr)
 	} else
 		p = mmap(NULL, size + 2*GUARD_SIZE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
 	assert(p != MAP_FAILED);
-	p = mmap(p+GUARD_SIZE, size, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-	assert(p != MAP_FAILED);
-	return p;
+	void *q = mmap(p+GUARD_SIZE, size, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (q == MAP_FAILED) {
+		/* every live object costs 3 VMAs, we can run into vm.max_map_count */
+		munmap(p, size + 2*GUARD_SIZE);
+		return NULL;
+	}
+	return q;
 }
 
 static inline void guard_free(void *p, size_t size)
@@ -163,59 +247,426 @@ static inline void guard_free(void *p, size_t size)
 	munmap(p - GUARD_SIZE, size + 2*GUARD_SIZE);
 }
 
+/*
+ * Pool mode.  guard_alloc() costs two mmaps plus retries when the random
+ * address is already taken.  With a pool we reserve a large PROT_NONE range
+ * up front and only have to make the allocation itself accessible, one
+ * mprotect.  Guard pages are simply the rest of the region.
+ */
+static inline void *pool_alloc(size_t size, u64 addr)
+{
+	if (mprotect((void *)addr, size, PROT_READ|PROT_WRITE))
+		return NULL;
+	return (void *)addr;
+}
+
+/*
+ * Map fresh PROT_NONE pages over the allocation and guards.  That drops the
+ * memory, undoes any fault fixups in the guards and is a single syscall.
+ */
+static inline void pool_free(void *p, size_t size)
+{
+	void *ret = mmap(p - GUARD_SIZE, size + 2*GUARD_SIZE, PROT_NONE,
+			MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (ret == MAP_FAILED) {
+		/* can fail when out of VMAs, fall back to the slow way */
+		mprotect(p - GUARD_SIZE, size + 2*GUARD_SIZE, PROT_NONE);
+		madvise(p - GUARD_SIZE, size + 2*GUARD_SIZE, MADV_DONTNEED);
+	}
+}
+
 #define FL_USED		(1<<0)
 #define FL_FRONTPAD	(1<<1)
 #define FL_FAULT	(1<<2)
+/*
+ * Hot metadata only, the alloc and free paths touch a single cacheline.
+ * Backtraces are cold and live in the stack depot, referenced by id.
+ */
 struct mapping {
 	void *p;
-	size_t size;
-	size_t pad;
-	size_t flags;
 	u64 alloc_time;
-	void *alloc_bt[29];
 	u64 free_time;
-	void *free_bt[29];
+	u32 size;
+	u32 pad;
+	u32 flags;
+	u32 alloc_stack;
+	u32 free_stack;
+};
+
+/*
+ * Stack depot, modeled after the kernel's.  Most allocations come from a
+ * handful of call sites, so we store every distinct backtrace once and refer
+ * to it by a 32bit id.  Records live in a MAP_NORESERVE area that only gets
+ * populated as it fills up.  Records are never freed and never change once
+ * published, so lookups need no locking.  Two threads inserting the same
+ * stack at the same time may create a duplicate, which is harmless.  Once
+ * the depot is full, new stacks get id 0 and are lost.
+ */
+#define STACK_DEPTH	29
+#define DEPOT_SIZE	(16<<20)	/* 16MiB */
+#define DEPOT_BITS	14
+struct stack_record {
+	u32 next; /* hash chain */
+	u32 depth;
+	u64 hash;
+	void *frames[];
 };
 
-struct map {
-	struct mapping m[128];
-} map = {};
+static char *depot;
+static u64 depot_used = 8; /* id 0 means no stack */
+static u32 depot_bucket[1<<DEPOT_BITS];
+
+static inline struct stack_record *stack_record(u32 id)
+{
+	return (void *)(depot + id*8ull);
+}
+
+static u64 stack_hash(void **frames, u32 depth)
+{
+	u64 hash = depth;
+	for (u32 i=0; i<depth; i++)
+		hash = (hash ^ (u64)frames[i]) * 0x9e3779b97f4a7c15ull;
+	return hash ^ hash>>29;
+}
+
+static u32 depot_save(void **frames, u32 depth)
+{
+	u64 hash = stack_hash(frames, depth);
+	u32 *bucket = &depot_bucket[hash >> (64-DEPOT_BITS)];
+	struct stack_record *rec;
+	u32 id, head;
+
+	for (id = __atomic_load_n(bucket, __ATOMIC_ACQUIRE); id; id = rec->next) {
+		rec = stack_record(id);
+		if (rec->hash == hash && rec->depth == depth &&
+				!memcmp(rec->frames, frames, depth*sizeof(frames[0])))
+			return id;
+	}
+	if (unlikely(!READ_ONCE(depot))) {
+		void *p = mmap(NULL, DEPOT_SIZE, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		assert(p != MAP_FAILED);
+		if (!__sync_bool_compare_and_swap(&depot, NULL, p))
+			munmap(p, DEPOT_SIZE);
+	}
+	u64 bytes = ALIGN_UP(sizeof(*rec) + depth*sizeof(frames[0]), 8);
+	u64 off = __sync_fetch_and_add(&depot_used, bytes);
+	if (off + bytes > DEPOT_SIZE)
+		return 0;
+	id = off/8;
+	rec = stack_record(id);
+	rec->hash = hash;
+	rec->depth = depth;
+	memcpy(rec->frames, frames, depth*sizeof(frames[0]));
+	do {
+		head = READ_ONCE(*bucket);
+		rec->next = head;
+	} while (!__atomic_compare_exchange_n(bucket, &head, id, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return id;
+}
+
+/* returns the number of frames, 0 if the stack was lost */
+static u32 depot_fetch(u32 id, void ***frames)
+{
+	if (!id)
+		return 0;
+	struct stack_record *rec = stack_record(id);
+	*frames = rec->frames;
+	return rec->depth;
+}
+
+/*
+ * Frame pointer unwinder.  glibc backtrace() goes through the DWARF unwinder,
+ * which is slow and not async-signal-safe.  Following the rbp chain costs a
+ * load or two per frame, but only sees code compiled with
+ * -fno-omit-frame-pointer.  Code without frame pointers may use rbp for
+ * anything, so we stop at the first frame pointer that doesn't point further
+ * up the stack, isn't aligned or is too far away to plausibly be our caller's
+ * frame.  That alone can still walk off the top of the stack, so we also
+ * stop at hi, the end of the thread stack.  Thread stacks end with a NULL
+ * frame pointer.
+ */
+#define MAX_FRAME_SIZE	(1<<20)
+static inline u32 fp_walk(void **fp, void **frames, u32 max, void *hi)
+{
+	u32 n = 0;
+
+	while (n < max) {
+		void **next = fp[0];
+		if (!fp[1])
+			break;
+		frames[n++] = fp[1];
+		if (next <= fp || (void *)next - (void *)fp > MAX_FRAME_SIZE || (u64)next & 7)
+			break;
+		if ((void *)(next + 2) > hi)
+			break;
+		fp = next;
+	}
+	return n;
+}
+
+static __attribute__((noinline)) u32 fp_backtrace(void **frames, u32 max, void *hi)
+{
+	return fp_walk(__builtin_frame_address(0), frames, max, hi);
+}
+
+/* pthread.h only declares this with _GNU_SOURCE, which clashes with gettid() */
+int pthread_getattr_np(pthread_t thread, pthread_attr_t *attr);
+
+static __thread void *stack_hi;
+static __thread int stack_hi_busy;
+
+/*
+ * End of the current thread's stack, looked up once per thread.  For the
+ * main thread pthread_getattr_np() reads /proc/self/maps with stdio, which
+ * mallocs, which may end up right back here.  Nested calls get NULL.
+ */
+static void *thread_stack_hi(void)
+{
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+
+	if (likely(stack_hi))
+		return stack_hi;
+	if (stack_hi_busy)
+		return NULL;
+	stack_hi_busy = 1;
+	if (!pthread_getattr_np(pthread_self(), &attr)) {
+		if (!pthread_attr_getstack(&attr, &addr, &size))
+			stack_hi = addr + size;
+		pthread_attr_destroy(&attr);
+	}
+	if (!stack_hi)
+		stack_hi = (void *)sizeof(void *); /* unknown, don't walk */
+	stack_hi_busy = 0;
+	return stack_hi;
+}
+
+static u32 save_stack(void)
+{
+	void *frames[STACK_DEPTH];
+	void *hi = thread_stack_hi();
+
+	if (!hi)
+		return 0;
+	return depot_save(frames, fp_backtrace(frames, STACK_DEPTH, hi));
+}
+
+/*
+ * The list is split into shards of shard_size slots, each with its own lock
+ * and FIFO.  An allocation only locks the shard its list slot belongs to, so
+ * allocations on different threads rarely collide.  Htable slots are shared
+ * between shards and claimed with cmpxchg.
+ *
+ * ufence_free() takes no lock at all.  The caller owns the object, so it can
+ * update the mapping directly and then publishes the slot in the shard's
+ * FIFO.  Producers claim a FIFO position with an atomic add and write the
+ * slot number afterwards.  Slot 0 is never used, so a 0 entry means "claimed,
+ * but not written yet".
+ *
+ * FIFO of freed list slots, roughly in order of free_time.  Slots between
+ * expire and protect are protected, between protect and head they still
+ * await their mprotect.  Each slot is in there at most once, so shard_size
+ * entries are enough.
+ */
+#define MAX_SHARDS	64
+#define MIN_SHARD_SIZE	16
+struct ufence_shard {
+	struct lock_pi lock;
+	u32 head;
+	/* reaper-owned */
+	u32 protect;
+	u32 expire;
+} __attribute__((aligned(64)));
 
-struct lock_pi ufence_lock;
+/* Per size class.  Pool fields are NULL unless initialized with ufence_init_pool() */
+struct ufence_class {
+	u32 *htable;
+	u32 htable_size;
+	void *pool;
+	u64 pool_regions;
+};
 
 struct ufence_hmap {
-	u64 hmap_size; /* size of this structure, including list and htable */
+	u64 hmap_size; /* size of this structure, including list and htables */
 	u64 mem_limit;
 	u64 mem_used;
 	u32 list_size;
-	u32 htable_size;
+	u32 nr_shards;
+	u32 shard_size;
+	/* ufence_free() calls in progress, see ufence_set_mem_limit() */
+	u32 freeing;
+	u32 retired;
 
 	struct mapping *list;
-	u32 *htable;
-	u64 pad[2];
+	u32 *fifo;
+	struct ufence_class class[NR_CLASSES];
+	struct ufence_shard shard[MAX_SHARDS];
 } *ufence_hmap;
 
-static void ufence_init(u64 mem_limit)
+static inline u32 lslot_shard_nr(struct ufence_hmap *h, u32 lslot)
+{
+	return lslot / h->shard_size;
+}
+
+static inline struct ufence_shard *lslot_shard(struct ufence_hmap *h, u32 lslot)
+{
+	return &h->shard[lslot_shard_nr(h, lslot)];
+}
+
+static inline u32 *shard_fifo(struct ufence_hmap *h, struct ufence_shard *s, u32 pos)
+{
+	u32 i = s - h->shard;
+	return &h->fifo[i * h->shard_size + pos % h->shard_size];
+}
+
+/*
+ * Counters for ufence_get_stats().  Indexed by shard number, so threads
+ * working on different shards don't bounce a shared cacheline.  They are
+ * not part of the hmap and survive resizing.
+ */
+struct ufence_counters {
+	u64 samples;
+	u64 allocs;
+	u64 backoff_busy;
+	u64 backoff_quarantine;
+	u64 backoff_quota;
+	u64 backoff_addr;
+	u64 frees;
+	u64 faults;
+} __attribute__((aligned(64)));
+
+static struct ufence_counters ufence_counters[MAX_SHARDS];
+#define COUNT(shard_nr, field)	\
+	__atomic_fetch_add(&ufence_counters[shard_nr].field, 1, __ATOMIC_RELAXED)
+
+static void start_reaper(void);
+
+/*
+ * Big objects eat quota fast, so larger classes get proportionally smaller
+ * htables.  Keep some minimum to make htable collisions rare.
+ */
+#define MIN_HTABLE	64
+static struct ufence_hmap *alloc_hmap(u64 mem_limit, u64 list_size, u64 *htable_size)
+{
+	u32 nr_shards = MAX_SHARDS;
+	while (nr_shards > 1 && list_size / nr_shards < MIN_SHARD_SIZE)
+		nr_shards /= 2;
+	list_size = ALIGN_UP(list_size, nr_shards);
+	assert((u32)list_size == list_size);
+	u64 hmap_size = sizeof(struct ufence_hmap)
+		+ list_size*sizeof(struct mapping) + list_size*sizeof(u32);
+	for (u32 c=0; c<NR_CLASSES; c++) {
+		assert((u32)htable_size[c] == htable_size[c]);
+		hmap_size += htable_size[c]*sizeof(u32);
+	}
+	struct ufence_hmap *h = guard_alloc(hmap_size, 0);
+	assert(h);
+	h->hmap_size = hmap_size;
+	h->mem_limit = mem_limit;
+	h->mem_used = hmap_size;
+	h->list_size = list_size;
+	h->list = (void *) (h+1);
+	h->fifo = (void *) (h->list+list_size);
+	u32 *htable = h->fifo+list_size;
+	for (u32 c=0; c<NR_CLASSES; c++) {
+		h->class[c].htable = htable;
+		h->class[c].htable_size = htable_size[c];
+		htable += htable_size[c];
+	}
+	h->nr_shards = nr_shards;
+	h->shard_size = list_size / nr_shards;
+	return h;
+}
+
+static u64 lothash(u64 val, u64 limit)
+{
+	val = ALIGN_DOWN(val, REGION_SIZE);
+	u64 m = 0x1da177e4c3f41524ull | 1 | 1ull<<63; /* Let it rip! */
+	u128 p = val;
+	p *= m;
+	m = p ^ p>>64;
+	p = m;
+	p *= limit;
+	return p>>64;
+}
+
+/* NULL if addr is outside all classes, e.g. regular heap or stack */
+static inline u32 *htable_slot(struct ufence_hmap *h, u64 addr)
+{
+	u32 c = addr_class(addr);
+	if (c >= NR_CLASSES)
+		return NULL;
+	struct ufence_class *cl = &h->class[c];
+	return &cl->htable[lothash(ALIGN_DOWN(addr, region_size(c)), cl->htable_size)];
+}
+
+static u64 clamp_mem_limit(u64 mem_limit)
 {
 	if (mem_limit < 2*PAGE_SIZE)
 		mem_limit = 2*PAGE_SIZE;
 	if (mem_limit > HARD_LIMIT)
 		mem_limit = HARD_LIMIT;
-	u64 list_size   = mem_limit / (PAGE_SIZE*2);
-	u64 htable_size = mem_limit / (PAGE_SIZE/2);
-	assert((u32)list_size == list_size);
-	assert((u32)htable_size == htable_size);
-	u64 hmap_size = sizeof(struct ufence_hmap)
-		+ list_size*sizeof(struct mapping) + htable_size*sizeof(u32);
+	return mem_limit;
+}
+
+static void ufence_init(u64 mem_limit)
+{
+	u64 htable_size[NR_CLASSES];
+
+	mem_limit = clamp_mem_limit(mem_limit);
 	assert(!ufence_hmap);
-	ufence_hmap = guard_alloc(hmap_size, 0);
-	ufence_hmap->hmap_size = hmap_size;
-	ufence_hmap->mem_limit = mem_limit;
-	ufence_hmap->mem_used = hmap_size;
-	ufence_hmap->list_size = list_size;
-	ufence_hmap->htable_size = htable_size;
-	ufence_hmap->list   = (void *) (ufence_hmap+1);
-	ufence_hmap->htable = (void *) (ufence_hmap->list+list_size);
+	for (u32 c=0; c<NR_CLASSES; c++) {
+		htable_size[c] = mem_limit / (PAGE_SIZE/2) >> 2*c;
+		if (htable_size[c] < MIN_HTABLE)
+			htable_size[c] = MIN_HTABLE;
+	}
+	ufence_hmap = alloc_hmap(mem_limit, mem_limit / (PAGE_SIZE*2), htable_size);
+	start_reaper();
+}
+
+/*
+ * Like ufence_init(), but allocate from a pre-reserved pool of regions.  We
+ * reserve POOL_FACTOR times as many regions as we have list slots, so there
+ * is still plenty of randomness in where objects end up.  PROT_NONE costs
+ * address space, but no memory.
+ */
+#define POOL_FACTOR	4
+static u64 rand_n(u64 n);
+static void reserve_pool(struct ufence_hmap *h)
+{
+	for (u32 c=0; c<NR_CLASSES; c++) {
+		struct ufence_class *cl = &h->class[c];
+		u64 rsize = region_size(c);
+		u64 regions = POOL_FACTOR * (u64)h->list_size >> 2*c;
+		if (regions < POOL_FACTOR)
+			regions = POOL_FACTOR;
+		if (regions > CLASS_SPACE/16/rsize)
+			regions = CLASS_SPACE/16/rsize;
+		/* the pool has to be within the class's part of the address space */
+		void *p = MAP_FAILED;
+		for (int i=0; i<100 && p == MAP_FAILED; i++) {
+			u64 addr = class_base(c) + (1 + rand_n(CLASS_SPACE/rsize - regions - 1)) * rsize;
+			p = mmap((void *)addr, regions * rsize, PROT_NONE,
+					MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED_NOREPLACE, -1, 0);
+			if (p != MAP_FAILED && p != (void *)addr) {
+				/* kernel < 4.17 */
+				munmap(p, regions * rsize);
+				p = MAP_FAILED;
+			}
+		}
+		assert(p != MAP_FAILED);
+		cl->pool_regions = regions;
+		cl->pool = p;
+	}
+}
+
+void ufence_init_pool(u64 mem_limit)
+{
+	ufence_init(mem_limit);
+	reserve_pool(ufence_hmap);
 }
 
 static u64 get_monotonic(void)
@@ -225,216 +676,1021 @@ static u64 get_monotonic(void)
 	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
+/*
+ * Whisperrandom, see ldpc.c.  getrandom() is a syscall and far too slow to
+ * call several times per allocation.  Each thread seeds b once and then
+ * counts up a.
+ */
+#define M0	(0x62aa751d16399637ull)
+static __thread struct {
+	u64 a;
+	u64 b;
+} rand_state;
+
+static inline void whisper(u64 *a, u64 *b, u64 m)
+{
+	u128 p = *a;
+	p *= m;
+	*a = p;
+	*b ^= p >> 64;
+}
+
+static u64 rand64()
+{
+	if (unlikely(!rand_state.b)) {
+		while (getrandom(&rand_state.b, sizeof(rand_state.b), 0) != sizeof(rand_state.b))
+			;
+		rand_state.b |= 1;
+	}
+	u64 a = rand_state.a;
+	u64 b = rand_state.b;
+	rand_state.a += M0;
+	whisper(&a, &b, M0);
+	whisper(&b, &a, M0);
+	whisper(&a, &b, M0);
+	return b * M0;
+}
+
 /* returns a random number in the range 0..n-1 (or 0 when n is 0) */
 static u64 rand_n(u64 n)
 {
-	u64 r;
-	getrandom(&r, sizeof(r), 0);
-	u128 p = r;
+	u128 p = rand64();
 	p *= n;
 	return p>>64;
 }
 
-static u64 rand64()
+/*
+ * Sampling gate.  sample_countdown is decremented on every allocation and
+ * only when it runs out do we enter ufence proper.  The next countdown is
+ * drawn from an exponential distribution with mean ufence_sample_interval,
+ * so sampling is memoryless.
+ */
+#define DEFAULT_SAMPLE_INTERVAL	(1<<16)
+static u64 ufence_sample_interval = DEFAULT_SAMPLE_INTERVAL;
+static __thread s64 sample_countdown;
+
+/*
+ * -ln(r/2^64) in 16.16 fixed point.  Integer part of -log2 from the leading
+ * zeroes, fraction from a quadratic fit of log2(1+f), error below 1%.
+ * Avoids libm and floating point in an allocator.
+ */
+static u64 neg_ln(u64 r)
 {
-	u64 r;
-	getrandom(&r, sizeof(r), 0);
-	return r;
+	r |= 1;
+	u32 lz = __builtin_clzll(r);
+	u64 f = (r << lz << 1) >> 48;
+	u64 log2_1f = f + (((f * (0x10000 - f)) >> 16) * 22282 >> 16);
+	u64 neg_log2 = ((u64)(lz+1) << 16) - log2_1f;
+	return neg_log2 * 45426 >> 16; /* ln(2) = 45426/2^16 */
 }
 
-static u64 lothash(u64 val, u64 limit)
+static s64 next_sample_countdown(void)
 {
-	val = ALIGN_DOWN(val, REGION_SIZE);
-	u64 m = 0x1da177e4c3f41524ull | 1 | 1ull<<63; /* Let it rip! */
-	u128 p = val;
-	p *= m;
-	m = p ^ p>>64;
-	p = m;
-	p *= limit;
-	return p>>64;
+	u128 n = READ_ONCE(ufence_sample_interval) - 1;
+	n *= neg_ln(rand64());
+	return (n >> 16) + 1;
 }
 
-void *_ufence_hmap_alloc(size_t size, int frontpad)
+/* returns 1 if this allocation should go to ufence */
+static inline int ufence_sample(void)
 {
+	if (likely(--sample_countdown > 0))
+		return 0;
+	if (unlikely(sample_countdown < 0)) {
+		/* new thread, start with a random countdown */
+		sample_countdown = next_sample_countdown();
+		return ufence_sample();
+	}
+	sample_countdown = next_sample_countdown();
+	return 1;
+}
+
+/* Average number of allocations between samples, 1 samples everything */
+void ufence_set_sample_interval(u64 interval)
+{
+	if (!interval)
+		interval = 1;
+	WRITE_ONCE(ufence_sample_interval, interval);
+}
+
+void *_ufence_hmap_alloc(size_t size, int frontpad, u32 c)
+{
+	struct ufence_hmap *h = __atomic_load_n(&ufence_hmap, __ATOMIC_ACQUIRE);
 	size_t outer = ALIGN_UP(size, PAGE_SIZE);
 	void *ret = NULL;
-	if (!trylock_pi(&ufence_lock))
-		return NULL;
 	/* backoff mechanism 1: pick a random slot and bail if it's in use */
-	u32 lslot = rand_n(ufence_hmap->list_size);
-	if (!lslot)
-		goto out;
-	struct mapping *m = &ufence_hmap->list[lslot];
-	if (m->flags & FL_USED || (get_monotonic() - m->free_time < 60000000000ull))
-		goto out;
+	u32 lslot = rand_n(h->nr_shards * h->shard_size);
+	u32 shard_nr = lslot_shard_nr(h, lslot);
+	COUNT(shard_nr, samples);
+	if (!lslot) {
+		COUNT(shard_nr, backoff_busy);
+		return NULL;
+	}
+	struct mapping *m = &h->list[lslot];
+	/* in use or in quarantine, the reaper clears m->p once it expired */
+	if (READ_ONCE(m->p)) {
+		if (READ_ONCE(m->flags) & FL_USED)
+			COUNT(shard_nr, backoff_busy);
+		else
+			COUNT(shard_nr, backoff_quarantine);
+		return NULL;
+	}
+	/*
+	 * A busy shard is just another reason to back off.  Retired hmaps
+	 * keep their shard locks held, so we also end up here if we raced
+	 * with ufence_set_mem_limit().
+	 */
+	struct ufence_shard *s = &h->shard[shard_nr];
+	if (!trylock_pi(&s->lock)) {
+		COUNT(shard_nr, backoff_busy);
+		return NULL;
+	}
 	if (m->p) {
-		/* permanently free memory in this slot */
-		size_t outer = m->size + m->pad;
-		void *p = m->p;
-		if (m->flags & FL_FRONTPAD)
-			p -= m->pad;
-		u32 hslot = lothash((u64)p, ufence_hmap->htable_size);
-		ufence_hmap->htable[hslot] = 0;
-		m->p = 0;
-		guard_free(p, outer);
-		ufence_hmap->mem_used -= outer;
+		COUNT(shard_nr, backoff_busy);
+		goto out;
 	}
 	/* backoff mechanism 2: bail based on remaining free space */
-	u64 n = rand_n(ufence_hmap->mem_limit);
-	n += ufence_hmap->mem_used + outer;
-	if (n > ufence_hmap->mem_limit)
+	u64 n = rand_n(h->mem_limit);
+	n += READ_ONCE(h->mem_used) + outer;
+	if (n > h->mem_limit) {
+		COUNT(shard_nr, backoff_quota);
 		goto out;
+	}
+	struct ufence_class *cl = &h->class[c];
 	for (int i=0; i<10; i++) {
 		/* Find a random address that hashes to a free slot */
-		u64 addr = rand64() & ADDR_MASK;
+		u64 addr;
+		if (cl->pool)
+			addr = (u64)cl->pool + rand_n(cl->pool_regions) * region_size(c);
+		else
+			addr = class_base(c) + (rand64() & (CLASS_SPACE - region_size(c)));
 		if (!addr)
 			continue;
-		addr += MAX_ALIGN; /* middle of region */
-		u32 hslot = lothash(addr, ufence_hmap->htable_size);
-		if (ufence_hmap->htable[hslot])
+		addr += max_align(c); /* middle of region */
+		u32 *hp = htable_slot(h, addr);
+		/*
+		 * Claim the htable slot before touching memory, other shards
+		 * might race for the same slot.  ufence_find() ignores us
+		 * until m->p is set.
+		 */
+		if (READ_ONCE(*hp) || !__sync_bool_compare_and_swap(hp, 0, lslot))
 			continue;
-		/* allocation with MAP_FIXED_NOREPLACE can fail */
-		void *p = guard_alloc(outer, addr);
-		if (!p)
+		/*
+		 * Pool regions with a free htable slot are unused.  Outside
+		 * the pool, allocation with MAP_FIXED_NOREPLACE can fail.
+		 */
+		void *p = cl->pool ? pool_alloc(outer, addr) : guard_alloc(outer, addr);
+		if (!p) {
+			*hp = 0;
 			continue;
+		}
 		if (p != (void*)addr) {
 			/* Can happen with kernel < 4.17 */
 			guard_free(p, outer);
+			*hp = 0;
 			break;
 		}
-		ufence_hmap->htable[hslot] = lslot;
 
 		m->alloc_time = get_monotonic();
 		m->p = p;
 		m->size = size;
 		m->pad = outer-size;
 		m->flags = FL_USED;
-		if (m->pad && rand64()&1) {
+		if (m->pad && frontpad) {
 			m->p += m->pad;
 			m->flags |= FL_FRONTPAD;
 		}
-		backtrace(m->alloc_bt, ARRAY_SIZE(m->alloc_bt));
+		m->alloc_stack = save_stack();
 		ret = m->p;
-		ufence_hmap->mem_used += outer;
+		__sync_fetch_and_add(&h->mem_used, outer);
+		COUNT(shard_nr, allocs);
 		break;
 	}
+	if (!ret)
+		COUNT(shard_nr, backoff_addr);
 out:
-	unlock_pi(&ufence_lock);
+	unlock_pi(&s->lock);
 	return ret;
 }
 
+/*
+ * Returns the mapping if p is a live ufence allocation, NULL otherwise.  A
+ * single htable probe without locking, cheap enough to call on every free().
+ * If p isn't ours, no live ufence mapping can start at p.  If it is ours, the
+ * caller owns it and nobody else changes the mapping.
+ */
+struct mapping *ufence_find(void *p)
+{
+	struct ufence_hmap *h = __atomic_load_n(&ufence_hmap, __ATOMIC_ACQUIRE);
+	if (!h)
+		return NULL;
+	u32 *hp = htable_slot(h, (u64)p);
+	if (!hp)
+		return NULL;
+	u32 lslot = READ_ONCE(*hp);
+	if (!lslot)
+		return NULL;
+	struct mapping *m = &h->list[lslot];
+	if (READ_ONCE(m->p) != p || !(READ_ONCE(m->flags) & FL_USED))
+		return NULL;
+	return m;
+}
+
+/* No syscalls and no locks, the reaper does the mprotect */
 void ufence_free(void *p)
 {
-	lock_pi(&ufence_lock);
-	u32 hslot = lothash((u64)p, ufence_hmap->htable_size);
-	u32 lslot = ufence_hmap->htable[hslot];
-	struct mapping *m = &ufence_hmap->list[lslot];
+	struct ufence_hmap *h;
+
+	for (;;) {
+		h = __atomic_load_n(&ufence_hmap, __ATOMIC_ACQUIRE);
+		__sync_fetch_and_add(&h->freeing, 1);
+		if (likely(!READ_ONCE(h->retired)))
+			break;
+		/* hmap is being resized, wait for the new one */
+		__sync_fetch_and_sub(&h->freeing, 1);
+		while (READ_ONCE(ufence_hmap) == h)
+			sched_yield();
+	}
+	u32 lslot = *htable_slot(h, (u64)p);
+	struct mapping *m = &h->list[lslot];
+	struct ufence_shard *s = lslot_shard(h, lslot);
 
-	m->free_time = get_monotonic();
-	m->flags &= ~FL_USED;
-	size_t outer = m->size + m->pad;
 	assert(p == m->p);
+	m->free_stack = save_stack();
+	m->free_time = get_monotonic();
+	/* no shard lock, ufence_segfault() may be setting FL_FAULT */
+	__atomic_and_fetch(&m->flags, ~FL_USED, __ATOMIC_RELEASE);
+	u32 pos = __sync_fetch_and_add(&s->head, 1);
+	__atomic_store_n(shard_fifo(h, s, pos), lslot, __ATOMIC_RELEASE);
+	COUNT(lslot_shard_nr(h, lslot), frees);
+	__sync_fetch_and_sub(&h->freeing, 1);
+}
+
+/* start of the mapping, including front padding */
+static void *mapping_start(struct mapping *m)
+{
+	void *p = m->p;
 	if (m->flags & FL_FRONTPAD)
 		p -= m->pad;
-	mprotect(p, outer, PROT_NONE);
-	backtrace(m->free_bt, ARRAY_SIZE(m->free_bt));
-	unlock_pi(&ufence_lock);
+	return p;
 }
 
-static char *number(u64 n)
+/*
+ * One pass of the reaper over one shard.  Protects everything freed since
+ * the last pass and permanently frees everything whose quarantine has
+ * expired.  Slots between expire and head are owned by the reaper, nobody
+ * else touches them.  The shard lock is only taken to give the slot back.
+ */
+#define QUARANTINE_NS	60000000000ull	/* 1min */
+static void reap_shard(struct ufence_hmap *h, struct ufence_shard *s, u64 now)
 {
-	static char buf[30];
-	buf[29] = 0;
-	char *s = buf+29;
-	while (n>=1000) {
-		u32 frac = n%1000;
-		s -= 4;
-		s[0] = '_';
-		s[1] = '0' + frac/100; frac %= 100;
-		s[2] = '0' + frac/10;  frac %= 10;
-		s[3] = '0' + frac;
-		n /= 1000;
+	u32 head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+
+	for (; s->protect != head; s->protect++) {
+		u32 lslot = __atomic_load_n(shard_fifo(h, s, s->protect), __ATOMIC_ACQUIRE);
+		if (!lslot)
+			break; /* ufence_free() hasn't written it yet */
+		struct mapping *m = &h->list[lslot];
+		mprotect(mapping_start(m), m->size + m->pad, PROT_NONE);
 	}
-	while (n) {
-		*--s = '0' + n%10; n/=10;
+	while (s->expire != s->protect) {
+		u32 *fifo = shard_fifo(h, s, s->expire);
+		struct mapping *m = &h->list[*fifo];
+		if (now - m->free_time < QUARANTINE_NS)
+			break;
+		void *p = mapping_start(m);
+		size_t outer = m->size + m->pad;
+		/* release memory before the htable slot, or a pool region gets reused too early */
+		if (h->class[addr_class((u64)p)].pool)
+			pool_free(p, outer);
+		else
+			guard_free(p, outer);
+		/* free the FIFO entry before the slot can get freed again */
+		*fifo = 0;
+		s->expire++;
+		lock_pi(&s->lock);
+		*htable_slot(h, (u64)p) = 0;
+		m->flags = 0;
+		__atomic_store_n(&m->p, NULL, __ATOMIC_RELEASE);
+		unlock_pi(&s->lock);
+		__sync_fetch_and_sub(&h->mem_used, outer);
 	}
-	return s;
 }
 
-/* returns 1 if the segfault was in ufence memory, 0 if unrelated */
-int ufence_segfault(void *p)
+static struct lock_pi reaper_lock;
+static void ufence_reap(void)
 {
-	/* If possible, acquire the lock.  But the lock might already be held
-	 * by the same thread, leading to a deadlock.  In such a situation, we
-	 * work unlocked and hope for the best.  Given that we already received
-	 * a SIGSEGV, the worst that could happen won't be worse than the
-	 * situation we are already in. */
-	int locked = trylock_pi(&ufence_lock);
-	int ret = 0;
+	u64 now = get_monotonic();
 
-	u32 hslot = lothash((u64)p, ufence_hmap->htable_size);
-	u32 lslot = ufence_hmap->htable[hslot];
-	struct mapping *m = &ufence_hmap->list[lslot];
-	if (PTR_ALIGN_DOWN(p, REGION_SIZE) != PTR_ALIGN_DOWN(m->p, REGION_SIZE))
-		goto out;
+	lock_pi(&reaper_lock);
+	struct ufence_hmap *h = ufence_hmap;
+	for (u32 i=0; i<h->nr_shards; i++)
+		reap_shard(h, &h->shard[i], now);
+	unlock_pi(&reaper_lock);
+}
 
-	u64 now = get_monotonic();
-	fprintf(stderr, "ufence fault at %p (offset %zd of %zd) flags=%zx\n", p, p-m->p, m->size, m->flags);
-	{
-		void *fault_bt[30];
-		fprintf(stderr, "fault backtrace:\n");
-		backtrace(fault_bt, ARRAY_SIZE(fault_bt));
-		char **symbols = backtrace_symbols(fault_bt, ARRAY_SIZE(fault_bt));
-		for (int s=0; s<ARRAY_SIZE(fault_bt) && fault_bt[s]; s++)
-			fprintf(stderr, "%s\n", symbols[s]);
+/*
+ * Changing the memory limit at runtime.  Lowering it only lowers the quota,
+ * allocations back off until enough memory has been reaped.  Raising it may
+ * require larger tables.  lothash() scales the hash by the table size, so if
+ * the htable grows by a factor of 2^k, every old slot maps onto 2^k new
+ * slots of its own.  Rehashing into the new table can't collide, which is
+ * why tables only ever grow and only by powers of two.
+ *
+ * Rehashing happens under the reaper lock and with all shard locks of the
+ * old hmap held, so allocations and the reaper leave it alone.  ufence_free()
+ * takes no locks.  Instead it announces itself in h->freeing and waits for
+ * the new hmap once h->retired is set.  ufence_find() and fault handling
+ * may still read the old hmap, so it is never unmapped and keeps its shard
+ * locks forever.  Since tables at least double, that wastes at most as much
+ * memory as the current tables use.
+ */
+static void ufence_grow(u64 mem_limit)
+{
+	struct ufence_hmap *old = ufence_hmap;
+	u64 htable_size[NR_CLASSES];
+	u32 shift = 1;
+
+	while (((u64)old->list_size << shift) * (PAGE_SIZE*2) < mem_limit)
+		shift++;
+	for (u32 c=0; c<NR_CLASSES; c++)
+		htable_size[c] = (u64)old->class[c].htable_size << shift;
+	struct ufence_hmap *h = alloc_hmap(mem_limit, (u64)old->list_size << shift, htable_size);
+	if (old->class[0].pool)
+		reserve_pool(h);
+
+	for (u32 i=0; i<old->nr_shards; i++)
+		lock_pi(&old->shard[i].lock);
+	__atomic_store_n(&old->retired, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&old->freeing, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	/* list slots keep their numbers, the list only grows */
+	for (u32 lslot=1; lslot<old->list_size; lslot++) {
+		struct mapping *m = &old->list[lslot];
+		if (!m->p)
+			continue;
+		h->list[lslot] = *m;
+		u32 *hp = htable_slot(h, (u64)m->p);
+		assert(!*hp);
+		*hp = lslot;
 	}
-	{
-		fprintf(stderr, "alloc backtrace (%sns ago):\n", number(now - m->alloc_time));
-		char **symbols = backtrace_symbols(m->alloc_bt, ARRAY_SIZE(m->alloc_bt));
-		for (int s=0; s<ARRAY_SIZE(m->alloc_bt) && m->alloc_bt[s]; s++)
-			fprintf(stderr, "%s\n", symbols[s]);
+	/*
+	 * Requeue quarantined slots into the new shards.  Do the pending
+	 * mprotects first, so everything in the new FIFOs is protected.
+	 * Merged FIFOs are no longer strictly ordered by free_time, which
+	 * only means some slots leave quarantine a little late.
+	 */
+	for (u32 i=0; i<old->nr_shards; i++) {
+		struct ufence_shard *s = &old->shard[i];
+		for (; s->protect != s->head; s->protect++) {
+			struct mapping *m = &old->list[*shard_fifo(old, s, s->protect)];
+			mprotect(mapping_start(m), m->size + m->pad, PROT_NONE);
+		}
+		for (u32 pos = s->expire; pos != s->head; pos++) {
+			u32 lslot = *shard_fifo(old, s, pos);
+			struct ufence_shard *ns = lslot_shard(h, lslot);
+			*shard_fifo(h, ns, ns->head++) = lslot;
+		}
+	}
+	for (u32 i=0; i<h->nr_shards; i++)
+		h->shard[i].protect = h->shard[i].head;
+	/* the old hmap stays around and keeps counting */
+	h->mem_used = old->mem_used + h->hmap_size;
+	__atomic_store_n(&ufence_hmap, h, __ATOMIC_RELEASE);
+}
+
+void ufence_set_mem_limit(u64 mem_limit)
+{
+	mem_limit = clamp_mem_limit(mem_limit);
+	if (!ufence_hmap) {
+		ufence_init(mem_limit);
+		return;
+	}
+	lock_pi(&reaper_lock);
+	struct ufence_hmap *h = ufence_hmap;
+	if (mem_limit > (u64)h->list_size * (PAGE_SIZE*2))
+		ufence_grow(mem_limit);
+	else
+		WRITE_ONCE(h->mem_limit, mem_limit);
+	unlock_pi(&reaper_lock);
+}
+
+struct ufence_stats {
+	u64 samples;		/* sampled allocations */
+	u64 allocs;		/* ...that became ufence objects */
+	u64 backoff_busy;	/* slot in use or shard locked */
+	u64 backoff_quarantine;	/* slot still in quarantine */
+	u64 backoff_quota;	/* close to mem_limit */
+	u64 backoff_addr;	/* no usable address found */
+	u64 frees;
+	u64 faults;		/* faults caught by ufence_segfault() */
+	u64 mem_used;
+	u64 mem_limit;
+	u64 sample_interval;
+};
+
+/* Counters are read without stopping anyone, expect them to be slightly off */
+void ufence_get_stats(struct ufence_stats *st)
+{
+	struct ufence_hmap *h = __atomic_load_n(&ufence_hmap, __ATOMIC_ACQUIRE);
+
+	memset(st, 0, sizeof(*st));
+	for (u32 i=0; i<MAX_SHARDS; i++) {
+		struct ufence_counters *c = &ufence_counters[i];
+		st->samples		+= READ_ONCE(c->samples);
+		st->allocs		+= READ_ONCE(c->allocs);
+		st->backoff_busy	+= READ_ONCE(c->backoff_busy);
+		st->backoff_quarantine	+= READ_ONCE(c->backoff_quarantine);
+		st->backoff_quota	+= READ_ONCE(c->backoff_quota);
+		st->backoff_addr	+= READ_ONCE(c->backoff_addr);
+		st->frees		+= READ_ONCE(c->frees);
+		st->faults		+= READ_ONCE(c->faults);
+	}
+	if (h) {
+		st->mem_used = READ_ONCE(h->mem_used);
+		st->mem_limit = READ_ONCE(h->mem_limit);
+	}
+	st->sample_interval = READ_ONCE(ufence_sample_interval);
+}
+
+/*
+ * Config and stats files, polled by the reaper every CONFIG_NS.  The config
+ * file has lines of the form "mem_limit=<bytes>" or "sample_interval=<n>"
+ * and is reread whenever its mtime changes.  Stats get written to a
+ * temporary file and renamed, so readers never see a partial file.  Lets an
+ * outside agent raise coverage on canaries or back off under memory
+ * pressure without restarting anything.
+ */
+#define CONFIG_NS	1000000000ull	/* 1s */
+static const char *config_path;
+static const char *stats_path;
+
+void ufence_set_config_file(const char *path)
+{
+	WRITE_ONCE(config_path, path);
+}
+
+void ufence_set_stats_file(const char *path)
+{
+	WRITE_ONCE(stats_path, path);
+}
+
+static void read_config(void)
+{
+	static struct timespec mtime;
+	char buf[256];
+	struct stat st;
+
+	int fd = open(config_path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) || (st.st_mtim.tv_sec == mtime.tv_sec &&
+				st.st_mtim.tv_nsec == mtime.tv_nsec)) {
+		close(fd);
+		return;
+	}
+	mtime = st.st_mtim;
+	ssize_t len = read(fd, buf, sizeof(buf)-1);
+	close(fd);
+	if (len <= 0)
+		return;
+	buf[len] = 0;
+	for (char *line = buf; line; ) {
+		char *next = strchr(line, '\n');
+		if (next)
+			*next++ = 0;
+		char *val = strchr(line, '=');
+		if (val) {
+			*val++ = 0;
+			if (!strcmp(line, "mem_limit"))
+				ufence_set_mem_limit(strtoull(val, NULL, 0));
+			else if (!strcmp(line, "sample_interval"))
+				ufence_set_sample_interval(strtoull(val, NULL, 0));
+		}
+		line = next;
+	}
+}
+
+static void write_stats(void)
+{
+	struct ufence_stats st;
+	char buf[512], tmp[4096];
+
+	ufence_get_stats(&st);
+	int len = snprintf(buf, sizeof(buf),
+			"samples %llu\n"
+			"allocs %llu\n"
+			"backoff_busy %llu\n"
+			"backoff_quarantine %llu\n"
+			"backoff_quota %llu\n"
+			"backoff_addr %llu\n"
+			"frees %llu\n"
+			"faults %llu\n"
+			"mem_used %llu\n"
+			"mem_limit %llu\n"
+			"sample_interval %llu\n",
+			st.samples, st.allocs, st.backoff_busy,
+			st.backoff_quarantine, st.backoff_quota, st.backoff_addr,
+			st.frees, st.faults, st.mem_used, st.mem_limit,
+			st.sample_interval);
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", stats_path) >= (int)sizeof(tmp))
+		return;
+	int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	if (write(fd, buf, len) == len)
+		rename(tmp, stats_path);
+	close(fd);
+}
+
+#define REAPER_NS	10000000ull	/* 10ms */
+static void *ufence_reaper(void *arg)
+{
+	struct timespec ts = { .tv_nsec = REAPER_NS };
+
+	for (u64 i=0; ; i++) {
+		nanosleep(&ts, NULL);
+		ufence_reap();
+		if (i % (CONFIG_NS/REAPER_NS))
+			continue;
+		if (READ_ONCE(config_path))
+			read_config();
+		if (READ_ONCE(stats_path))
+			write_stats();
 	}
+	return NULL;
+}
+
+static void fork_prepare(void)
+{
+	lock_pi(&reaper_lock);
+	for (u32 i=0; i<ufence_hmap->nr_shards; i++)
+		lock_pi(&ufence_hmap->shard[i].lock);
+}
+
+static void fork_parent(void)
+{
+	for (u32 i=0; i<ufence_hmap->nr_shards; i++)
+		unlock_pi(&ufence_hmap->shard[i].lock);
+	unlock_pi(&reaper_lock);
+}
+
+/*
+ * Threads don't survive fork(), restart the reaper in the child.  PI locks
+ * contain the owner's tid, which is different in the child.
+ */
+static void fork_child(void)
+{
+	for (u32 i=0; i<ufence_hmap->nr_shards; i++)
+		ufence_hmap->shard[i].lock.lock = 0;
+	reaper_lock.lock = 0;
+	start_reaper();
+}
+
+static void start_reaper(void)
+{
+	static int atfork;
+	pthread_t tid;
+	sigset_t all, old;
+
+	if (!atfork++)
+		pthread_atfork(fork_prepare, fork_parent, fork_child);
+	/* signals are for the application, not for the reaper */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_create(&tid, NULL, ufence_reaper, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_detach(tid);
+}
+
+/*
+ * Fault reports are written from a SIGSEGV handler, so no stdio, no malloc
+ * and no backtrace_symbols().  We format into a stack buffer and write(2) it
+ * out.  Every frame is printed as raw address plus module and offset from
+ * /proc/self/maps.  Symbolization is left to an offline tool, e.g.
+ *	addr2line -f -i -e <module> <offset>
+ */
+struct report {
+	u32 len;
+	char buf[256];
+};
+
+static void report_flush(struct report *r)
+{
+	for (u32 done = 0; done < r->len; ) {
+		ssize_t ret = write(2, r->buf + done, r->len - done);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	r->len = 0;
+}
+
+static void report_char(struct report *r, char c)
+{
+	if (r->len == sizeof(r->buf))
+		report_flush(r);
+	r->buf[r->len++] = c;
+}
+
+static void report_str(struct report *r, const char *s)
+{
+	while (*s)
+		report_char(r, *s++);
+}
+
+static void report_hex(struct report *r, u64 n)
+{
+	char buf[16];
+	int i = 0;
+
+	report_str(r, "0x");
+	do {
+		buf[i++] = "0123456789abcdef"[n & 15];
+		n >>= 4;
+	} while (n);
+	while (i)
+		report_char(r, buf[--i]);
+}
+
+/* sep, if non-zero, separates groups of thousands */
+static void report_dec(struct report *r, s64 n, char sep)
+{
+	char buf[32];
+	int i = 0, digits = 0;
+	u64 u = n;
+
+	if (n < 0) {
+		report_char(r, '-');
+		u = -u;
+	}
+	do {
+		if (sep && digits && digits%3 == 0)
+			buf[i++] = sep;
+		buf[i++] = '0' + u%10;
+		u /= 10;
+		digits++;
+	} while (u);
+	while (i)
+		report_char(r, buf[--i]);
+}
+
+#define MAX_MODULES	16
+#define MODULE_PATH	128
+struct frame_info {
+	void *addr;
+	u64 offset; /* file offset within module */
+	int module; /* -1 if unknown */
+};
+
+struct symtab {
+	u32 nr_modules;
+	char path[MAX_MODULES][MODULE_PATH];
+};
+
+static u64 parse_hex(const char **s)
+{
+	u64 n = 0;
+
+	for (;;) {
+		char c = **s;
+		if (c >= '0' && c <= '9')
+			n = n*16 + c - '0';
+		else if (c >= 'a' && c <= 'f')
+			n = n*16 + c - 'a' + 10;
+		else
+			return n;
+		(*s)++;
+	}
+}
+
+/* "start-end perms offset dev inode path", only executable mappings matter */
+static void resolve_line(const char *s, struct frame_info *fi, u32 n, struct symtab *st)
+{
+	u64 start = parse_hex(&s);
+	if (*s++ != '-')
+		return;
+	u64 end = parse_hex(&s);
+	if (s[0] != ' ' || s[3] != 'x')
+		return;
+	s += 6;
+	u64 offset = parse_hex(&s);
+	for (int field = 0; field < 2; field++) {
+		while (*s == ' ')
+			s++;
+		while (*s && *s != ' ')
+			s++;
+	}
+	while (*s == ' ')
+		s++;
+
+	int module = -1;
+	for (u32 i=0; i<n; i++) {
+		u64 addr = (u64)fi[i].addr;
+		if (fi[i].module >= 0 || addr < start || addr >= end)
+			continue;
+		if (module < 0) {
+			if (st->nr_modules == MAX_MODULES)
+				return;
+			module = st->nr_modules++;
+			char *path = st->path[module];
+			int len = 0;
+			while (s[len] && len < MODULE_PATH-1) {
+				path[len] = s[len];
+				len++;
+			}
+			path[len] = 0;
+		}
+		fi[i].module = module;
+		fi[i].offset = addr - start + offset;
+	}
+}
+
+/* open() and read() are async-signal-safe, fopen() and getline() are not */
+static void scan_maps(void (*fn)(const char *line, void *arg), void *arg)
+{
+	char buf[512], line[256];
+	u32 len = 0;
+
+	int fd = open("/proc/self/maps", O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+	for (;;) {
+		ssize_t ret = read(fd, buf, sizeof(buf));
+		if (ret <= 0)
+			break;
+		for (ssize_t i=0; i<ret; i++) {
+			if (buf[i] != '\n') {
+				/* overlong lines only lose the end of the path */
+				if (len < sizeof(line)-1)
+					line[len++] = buf[i];
+				continue;
+			}
+			line[len] = 0;
+			fn(line, arg);
+			len = 0;
+		}
+	}
+	close(fd);
+}
+
+struct resolve_args {
+	struct frame_info *fi;
+	u32 n;
+	struct symtab *st;
+};
+
+static void resolve_fn(const char *line, void *arg)
+{
+	struct resolve_args *a = arg;
+	resolve_line(line, a->fi, a->n, a->st);
+}
+
+static void resolve_frames(struct frame_info *fi, u32 n, struct symtab *st)
+{
+	struct resolve_args a = { fi, n, st };
+	scan_maps(resolve_fn, &a);
+}
+
+static void mapping_end_fn(const char *s, void *arg)
+{
+	u64 *addr = arg;
+	u64 start = parse_hex(&s);
+	if (*s++ != '-')
+		return;
+	u64 end = parse_hex(&s);
+	if (start <= *addr && *addr < end)
+		*addr = end;
+}
+
+/*
+ * Stack end for the fault backtrace.  We can't call pthread_getattr_np()
+ * from a signal handler, so threads that never sampled an allocation use
+ * the end of whatever mapping sp points into.
+ */
+static void *fault_stack_hi(void *sp)
+{
+	void *hi = READ_ONCE(stack_hi);
+	if (hi && sp < hi)
+		return hi;
+	u64 end = (u64)sp;
+	scan_maps(mapping_end_fn, &end);
+	return end == (u64)sp ? (void *)sizeof(void *) : (void *)end;
+}
+
+/* only defined with _GNU_SOURCE, which clashes with gettid() */
+#ifndef REG_RIP
+#define REG_RBP		10
+#define REG_RSP		15
+#define REG_RIP		16
+#endif
+
+/*
+ * Our own frames end in the signal trampoline, the faulting function is
+ * only found through the ucontext.  Frame #0 is the faulting pc, the walk
+ * starts at the interrupted rbp.  Code without frame pointers may keep
+ * anything in rbp, so it has to point into the interrupted stack.  Without
+ * a ucontext we walk from the signal handler.
+ */
+static u32 fault_backtrace(void **frames, u32 max, void *uc)
+{
+	if (!uc)
+		return fp_backtrace(frames, max, fault_stack_hi(__builtin_frame_address(0)));
+	mcontext_t *mc = &((ucontext_t *)uc)->uc_mcontext;
+	void **fp = (void **)mc->gregs[REG_RBP];
+	void *sp = (void *)mc->gregs[REG_RSP];
+	void *hi = fault_stack_hi(sp);
+
+	frames[0] = (void *)mc->gregs[REG_RIP];
+	if ((void *)fp < sp || (void *)(fp + 2) > hi || (u64)fp & 7)
+		return 1;
+	return 1 + fp_walk(fp, frames + 1, max - 1, hi);
+}
+
+static u32 add_frames(struct frame_info *fi, u32 n, void **frames, u32 depth)
+{
+	for (u32 i=0; i<depth; i++)
+		fi[n++] = (struct frame_info){ .addr = frames[i], .module = -1 };
+	return n;
+}
+
+static void report_stack(struct report *r, struct frame_info *fi, u32 n, struct symtab *st)
+{
+	for (u32 i=0; i<n; i++) {
+		report_str(r, "  #");
+		report_dec(r, i, 0);
+		report_char(r, ' ');
+		report_hex(r, (u64)fi[i].addr);
+		if (fi[i].module >= 0) {
+			report_char(r, ' ');
+			report_str(r, st->path[fi[i].module]);
+			report_char(r, '+');
+			report_hex(r, fi[i].offset);
+		}
+		report_char(r, '\n');
+	}
+}
+
+/*
+ * Backtraces for what just happened to m at p, its allocation and, if it
+ * was freed, its free.  Written to stderr in one go.
+ */
+static void report_mapping(struct mapping *m, const char *what, void *p, void **bt, u32 depth)
+{
+	u64 now = get_monotonic();
+	void **alloc_bt = NULL, **free_bt = NULL;
+	u32 alloc_depth = depot_fetch(m->alloc_stack, &alloc_bt);
+	u32 free_depth = m->flags & FL_USED ? 0 : depot_fetch(m->free_stack, &free_bt);
+	struct frame_info fi[3*STACK_DEPTH];
+	struct symtab st;
+	struct report r;
+	u32 n = 0;
+
+	n = add_frames(fi, n, bt, depth);
+	n = add_frames(fi, n, alloc_bt, alloc_depth);
+	n = add_frames(fi, n, free_bt, free_depth);
+	st.nr_modules = 0;
+	resolve_frames(fi, n, &st);
+
+	r.len = 0;
+	report_str(&r, "ufence ");
+	report_str(&r, what);
+	report_str(&r, " at ");
+	report_hex(&r, (u64)p);
+	report_str(&r, " (offset ");
+	report_dec(&r, p - m->p, 0);
+	report_str(&r, " of ");
+	report_dec(&r, m->size, 0);
+	report_str(&r, ") flags=");
+	report_hex(&r, m->flags);
+	report_char(&r, '\n');
+	report_str(&r, what);
+	report_str(&r, " backtrace:\n");
+	report_stack(&r, fi, depth, &st);
+	report_str(&r, "alloc backtrace (");
+	report_dec(&r, now - m->alloc_time, '_');
+	report_str(&r, "ns ago):\n");
+	report_stack(&r, fi + depth, alloc_depth, &st);
 	if (!(m->flags & FL_USED)) {
-		fprintf(stderr, "free backtrace (%sns ago):\n", number(now - m->free_time));
-		char **symbols = backtrace_symbols(m->free_bt, ARRAY_SIZE(m->free_bt));
-		for (int s=0; s<ARRAY_SIZE(m->free_bt) && m->free_bt[s]; s++)
-			fprintf(stderr, "%s\n", symbols[s]);
+		report_str(&r, "free backtrace (");
+		report_dec(&r, now - m->free_time, '_');
+		report_str(&r, "ns ago):\n");
+		report_stack(&r, fi + depth + alloc_depth, free_depth, &st);
 	}
-	fprintf(stderr, "\n");
+	report_char(&r, '\n');
+	report_flush(&r);
+}
+
+/*
+ * Returns 1 if the segfault was in ufence memory, 0 if unrelated.  uc is the
+ * third argument of an SA_SIGINFO handler and may be NULL, but then the
+ * fault backtrace starts in the handler and may miss the faulting function.
+ */
+int ufence_segfault(void *p, void *uc)
+{
+	struct ufence_hmap *h = __atomic_load_n(&ufence_hmap, __ATOMIC_ACQUIRE);
+	if (!h)
+		return 0; /* ufence_init() wasn't called, or not yet */
+	u32 *hp = htable_slot(h, (u64)p);
+	if (!hp)
+		return 0;
+	u32 lslot = READ_ONCE(*hp);
+	if (!lslot)
+		return 0;
+	struct mapping *m = &h->list[lslot];
+	struct ufence_shard *shard = lslot_shard(h, lslot);
+	/* If possible, acquire the shard lock.  But the lock might already be
+	 * held by the same thread, leading to a deadlock.  In such a situation,
+	 * we work unlocked and hope for the best.  Given that we already
+	 * received a SIGSEGV, the worst that could happen won't be worse than
+	 * the situation we are already in. */
+	int locked = trylock_pi(&shard->lock);
+	int ret = 0;
+
+	/* unused mappings have m->p == NULL, which a NULL deref would match */
+	u64 rsize = region_size(addr_class((u64)p));
+	if (!m->p || PTR_ALIGN_DOWN(p, rsize) != PTR_ALIGN_DOWN(m->p, rsize))
+		goto out;
+
+	void *fault_bt[STACK_DEPTH];
+	u32 fault_depth = fault_backtrace(fault_bt, STACK_DEPTH, uc);
+	report_mapping(m, "fault", p, fault_bt, fault_depth);
 
 	if (m->p-GUARD_SIZE < p && p < m->p+m->size+GUARD_SIZE) {
 		/* fixup permissions to handle fault gracefully */
-		m->flags |= FL_FAULT;
+		__atomic_or_fetch(&m->flags, FL_FAULT, __ATOMIC_RELAXED);
 		p = PTR_ALIGN_DOWN(p, PAGE_SIZE);
 		mprotect(p, PAGE_SIZE, PROT_READ|PROT_WRITE);
+		COUNT(lslot_shard_nr(h, lslot), faults);
 		ret = 1;
 	}
 out:
 	if (locked)
-		unlock_pi(&ufence_lock);
+		unlock_pi(&shard->lock);
+	return ret;
+}
+
+/*
+ * Returns 1 if p is a ufence object that was already freed and is still in
+ * quarantine, after reporting the double free.  Once the quarantine expired
+ * the slot is gone and we can't tell anymore.  Same locking as
+ * ufence_segfault(), the caller may hold the shard lock.
+ */
+int ufence_double_free(void *p)
+{
+	struct ufence_hmap *h = __atomic_load_n(&ufence_hmap, __ATOMIC_ACQUIRE);
+	if (!h)
+		return 0;
+	u32 *hp = htable_slot(h, (u64)p);
+	if (!hp)
+		return 0;
+	u32 lslot = READ_ONCE(*hp);
+	if (!lslot)
+		return 0;
+	struct mapping *m = &h->list[lslot];
+	struct ufence_shard *shard = lslot_shard(h, lslot);
+	int locked = trylock_pi(&shard->lock);
+	int ret = 0;
+
+	if (READ_ONCE(m->p) == p && !(READ_ONCE(m->flags) & FL_USED)) {
+		void *bt[STACK_DEPTH];
+		void *hi = thread_stack_hi();
+		report_mapping(m, "double free", p, bt, hi ? fp_backtrace(bt, STACK_DEPTH, hi) : 0);
+		ret = 1;
+	}
+	if (locked)
+		unlock_pi(&shard->lock);
 	return ret;
 }
 
 void *ufence_malloc(size_t size)
 {
-	if (size>MAX_ALLOC)
+	if (!ufence_sample())
+		return NULL;
+	u32 c = size_class(size, 0);
+	if (!size || c == NR_CLASSES)
 		return NULL;
 	int frontpad = 0;
 	if (size%PAGE_SIZE && rand64()&1)
 		frontpad = 1;
-	return _ufence_hmap_alloc(size, frontpad);
+	return _ufence_hmap_alloc(size, frontpad, c);
 }
 
 void *ufence_memalign(size_t alignment, size_t size)
 {
-	if (size>MAX_ALLOC || alignment>MAX_ALIGN)
+	if (!ufence_sample())
+		return NULL;
+	u32 c = size_class(size, alignment);
+	if (!size || c == NR_CLASSES)
 		return NULL;
-	return _ufence_hmap_alloc(size, 0);
+	return _ufence_hmap_alloc(size, 0, c);
 }
 
-static void signal_handler(int signal, siginfo_t *info, void *addr)
+#ifndef UFENCE_LIBRARY
+static void signal_handler(int signal, siginfo_t *info, void *uc)
 {
-	int kf = ufence_segfault(info->si_addr);
+	int kf = ufence_segfault(info->si_addr, uc);
 	if (kf)
 		return; /* ufence handled the segfault */
 	/* regular signal handler would follow... */
@@ -443,6 +1699,7 @@ static void signal_handler(int signal, siginfo_t *info, void *addr)
 int main(void)
 {
 	ufence_init(1ull<<21);
+	ufence_set_sample_interval(1);
 	{
 		/* set up signal handler */
 		struct sigaction act = {};
@@ -468,8 +1725,10 @@ int main(void)
 		memset(p-GUARD_SIZE+1, 1, 1);		/* buffer underrun */
 		memset(p+size-1+GUARD_SIZE, 1, 1);	/* buffer overflow */
 		ufence_free(p);
+		ufence_reap();				/* don't wait for the reaper */
 		memset(p, 1, 1);			/* use after free */
 		memset(p+size-1, 1, 1);			/* use after free */
 	}
 	return 0;
 }
+#endif
@@ -0,0 +1,469 @@
+/*
+ * Overhead benchmark for ufence.
+ *
+ *	gcc -O2 -fno-omit-frame-pointer -pthread ufence_bench.c -o ufence_bench
+ *	./ufence_bench -t 8 -n 1000000 -s mixed -l short
+ *	./ufence_bench -t 8 -r trace.txt -i 65536,1024 -m 64M,1G
+ *
+ * -t threads, -n operations per thread
+ * -s size distribution: small (8B-512B), mixed (8B-1MiB), large (64KiB-64MiB)
+ * -l lifetime: short (mean 32 operations) or long (mean 4096 operations)
+ * -r replay a trace instead of the synthetic workload
+ * -i sample intervals and -m memory limits to run ufence with
+ *
+ * Every thread keeps its live objects in a heap ordered by expiry.  Each
+ * operation frees the oldest object if it has expired and allocates a new
+ * one otherwise.  Sizes are log-uniform within the distribution, lifetimes
+ * exponential.  New objects get one byte written per page, so page faults
+ * show up where they belong.
+ *
+ * Trace files have one operation per line, "a <id> <size>" to allocate and
+ * "f <id>" to free.  Lines starting with # are ignored.  Every thread
+ * replays the whole trace with its own objects.  Objects still live at the
+ * end get freed without being measured.
+ *
+ * The base allocator runs first, then ufence for every combination of
+ * sample interval and memory limit.  ufence wraps the base allocator the
+ * same way ufence_preload.c does.  Each configuration runs in its own child
+ * process, so RSS and quarantine start from scratch.  We report throughput,
+ * latency percentiles of malloc+free calls in core cycles, peak RSS, minor
+ * faults and the syscalls ufence issued.  Syscalls of the base allocator
+ * itself are invisible to us, glibc calls them internally.  The table shows
+ * "-" for those instead of a misleading zero.
+ */
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Count every syscall ufence.c makes, including the reaper's */
+enum { SYS_MMAP, SYS_MUNMAP, SYS_MPROTECT, SYS_MADVISE, SYS_OTHER, NR_SYS };
+static unsigned long long nr_syscalls[NR_SYS];
+#define count_syscall(n)	__atomic_fetch_add(&nr_syscalls[n], 1, __ATOMIC_RELAXED)
+#define mmap(...)		(count_syscall(SYS_MMAP), mmap(__VA_ARGS__))
+#define munmap(...)		(count_syscall(SYS_MUNMAP), munmap(__VA_ARGS__))
+#define mprotect(...)		(count_syscall(SYS_MPROTECT), mprotect(__VA_ARGS__))
+#define madvise(...)		(count_syscall(SYS_MADVISE), madvise(__VA_ARGS__))
+#define syscall(...)		(count_syscall(SYS_OTHER), syscall(__VA_ARGS__))
+
+#define UFENCE_LIBRARY
+#include "ufence.c"
+
+#undef mmap
+#undef munmap
+#undef mprotect
+#undef madvise
+#undef syscall
+
+#define MALLOC_ALIGN	16
+#define MAX_LIVE	(1<<20)
+
+static u64 nr_threads = 4;
+static u64 nr_ops = 1<<20;
+static u32 size_lo, size_hi;	/* log2 of size range */
+static u64 mean_lifetime;
+static u64 tsc_per_64k_cycles;
+static u64 start;
+static int use_ufence;
+
+struct trace_op {
+	u32 id;
+	u32 size; /* 0 for free */
+};
+static struct trace_op *trace;
+static u64 trace_len;
+static u32 trace_ids;
+
+static inline u64 rdtsc(void)
+{
+	u32 lo, hi;
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return lo | (u64)hi << 32;
+}
+
+static inline u64 loop16(void)
+{
+	u64 t = rdtsc();
+	u64 rcx = 1ull<<16;
+	asm volatile ("1: sub $1, %%rcx; jg 1b" : "+c" (rcx));
+	t = rdtsc() - t;
+	return t;
+}
+
+/*
+ * Log-linear histogram of core cycles.  16 buckets per power of two keep
+ * the error for percentiles below 7%.
+ */
+#define HGRAM_SUB	16
+struct hgram {
+	u64 b[64*HGRAM_SUB];
+	u64 max;
+};
+
+static u32 hgram_bucket(u64 c)
+{
+	if (c < HGRAM_SUB)
+		return c;
+	u32 log = 63 - __builtin_clzll(c);
+	return (log-3) * HGRAM_SUB + ((c >> (log-4)) & (HGRAM_SUB-1));
+}
+
+static u64 hgram_value(u32 b)
+{
+	if (b < HGRAM_SUB)
+		return b;
+	u32 log = b/HGRAM_SUB + 3;
+	return (HGRAM_SUB + b%HGRAM_SUB) << (log-4);
+}
+
+static inline void hgram_add(struct hgram *h, u64 tsc)
+{
+	u128 c = tsc;
+	c <<= 16;
+	c /= tsc_per_64k_cycles;
+	h->b[hgram_bucket(c)]++;
+	if (c > h->max)
+		h->max = c;
+}
+
+static void hgram_merge(struct hgram *dst, struct hgram *src)
+{
+	for (u32 i=0; i<ARRAY_SIZE(dst->b); i++)
+		dst->b[i] += src->b[i];
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+static void hgram_print(struct hgram *h)
+{
+	static const double pct[] = { 50, 99, 99.9 };
+	u64 total = 0, sum = 0;
+	u32 p = 0;
+
+	for (u32 i=0; i<ARRAY_SIZE(h->b); i++)
+		total += h->b[i];
+	for (u32 i=0; i<ARRAY_SIZE(h->b) && p<ARRAY_SIZE(pct); i++) {
+		sum += h->b[i];
+		while (p<ARRAY_SIZE(pct) && sum >= total*pct[p]/100) {
+			printf(" %7lld", hgram_value(i));
+			p++;
+		}
+	}
+	printf(" %9lld", h->max);
+}
+
+static void *bench_malloc(size_t size)
+{
+	if (use_ufence) {
+		void *p = ufence_malloc(ALIGN_UP(size, MALLOC_ALIGN));
+		if (p)
+			return p;
+	}
+	return malloc(size);
+}
+
+static void bench_free(void *p)
+{
+	if (use_ufence && ufence_find(p)) {
+		ufence_free(p);
+		return;
+	}
+	free(p);
+}
+
+static void touch(char *p, size_t size)
+{
+	for (size_t i=0; i<size; i+=PAGE_SIZE)
+		p[i] = 1;
+	p[size-1] = 1;
+}
+
+static size_t random_size(void)
+{
+	u32 log = size_lo + rand_n(size_hi - size_lo);
+	return (1ull<<log) + rand_n(1ull<<log);
+}
+
+struct object {
+	u64 expire;
+	void *p;
+};
+
+/* min-heap of live objects by expiry */
+static void heap_push(struct object *heap, u64 *n, struct object o)
+{
+	u64 i = (*n)++;
+	while (i && heap[(i-1)/2].expire > o.expire) {
+		heap[i] = heap[(i-1)/2];
+		i = (i-1)/2;
+	}
+	heap[i] = o;
+}
+
+static struct object heap_pop(struct object *heap, u64 *n)
+{
+	struct object top = heap[0], last = heap[--*n];
+	u64 i = 0;
+
+	for (;;) {
+		u64 c = 2*i+1;
+		if (c >= *n)
+			break;
+		if (c+1 < *n && heap[c+1].expire < heap[c].expire)
+			c++;
+		if (heap[c].expire >= last.expire)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = last;
+	return top;
+}
+
+struct thread {
+	pthread_t tid;
+	struct hgram h;
+};
+
+static void synthetic(struct thread *t)
+{
+	struct object *heap = malloc(MAX_LIVE * sizeof(*heap));
+	u64 live = 0;
+
+	for (u64 op=0; op<nr_ops; op++) {
+		if (live && (heap[0].expire <= op || live == MAX_LIVE)) {
+			struct object o = heap_pop(heap, &live);
+			u64 t0 = rdtsc();
+			bench_free(o.p);
+			hgram_add(&t->h, rdtsc() - t0);
+			continue;
+		}
+		size_t size = random_size();
+		u64 t0 = rdtsc();
+		void *p = bench_malloc(size);
+		hgram_add(&t->h, rdtsc() - t0);
+		touch(p, size);
+		u64 lifetime = (mean_lifetime * neg_ln(rand64()) >> 16) + 1;
+		heap_push(heap, &live, (struct object){ op + lifetime, p });
+	}
+	while (live)
+		bench_free(heap_pop(heap, &live).p);
+	free(heap);
+}
+
+static void replay(struct thread *t)
+{
+	void **obj = calloc(trace_ids, sizeof(*obj));
+
+	for (u64 i=0; i<trace_len; i++) {
+		struct trace_op *op = &trace[i];
+		void *p = obj[op->id];
+		u64 t0 = rdtsc();
+		if (op->size) {
+			assert(!p);
+			p = obj[op->id] = bench_malloc(op->size);
+			hgram_add(&t->h, rdtsc() - t0);
+			touch(p, op->size);
+		} else {
+			assert(p);
+			bench_free(p);
+			hgram_add(&t->h, rdtsc() - t0);
+			obj[op->id] = NULL;
+		}
+	}
+	for (u32 id=0; id<trace_ids; id++)
+		if (obj[id])
+			bench_free(obj[id]);
+	free(obj);
+}
+
+static void *worker(void *arg)
+{
+	struct thread *t = arg;
+
+	while (!READ_ONCE(start))
+		sched_yield();
+	if (trace)
+		replay(t);
+	else
+		synthetic(t);
+	return NULL;
+}
+
+static void run(u64 interval, u64 mem_limit)
+{
+	struct thread *threads = calloc(nr_threads, sizeof(*threads));
+	struct hgram *h = calloc(1, sizeof(*h));
+	struct timespec t0, t1;
+	struct rusage ru;
+	char name[64];
+
+	if (interval) {
+		ufence_init(mem_limit);
+		ufence_set_sample_interval(interval);
+		use_ufence = 1;
+		snprintf(name, sizeof(name), "ufence 1/%lld %lldMiB", interval, mem_limit>>20);
+	} else {
+		snprintf(name, sizeof(name), "base");
+	}
+	for (u64 i=0; i<nr_threads; i++)
+		pthread_create(&threads[i].tid, NULL, worker, &threads[i]);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	WRITE_ONCE(start, 1);
+	for (u64 i=0; i<nr_threads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		hgram_merge(h, &threads[i].h);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	getrusage(RUSAGE_SELF, &ru);
+
+	u64 ops = 0;
+	for (u32 i=0; i<ARRAY_SIZE(h->b); i++)
+		ops += h->b[i];
+	double ns = (t1.tv_sec-t0.tv_sec)*1e9 + (t1.tv_nsec-t0.tv_nsec);
+	printf("%-24s %8.3f", name, ops * 1e3 / ns);
+	hgram_print(h);
+	printf(" %8ld %9ld", ru.ru_maxrss >> 10, ru.ru_minflt);
+	if (use_ufence) {
+		struct ufence_stats st;
+		ufence_get_stats(&st);
+		for (int i=0; i<NR_SYS; i++)
+			printf(" %8lld", READ_ONCE(nr_syscalls[i]));
+		printf(" %8lld", st.allocs);
+	} else {
+		/* not a zero, we just can't see them */
+		for (int i=0; i<=NR_SYS; i++)
+			printf(" %8s", "-");
+	}
+	printf("\n");
+}
+
+/* fork, so every run starts with a fresh heap, ufence and rusage */
+static void run_child(u64 interval, u64 mem_limit)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (!pid) {
+		run(interval, mem_limit);
+		fflush(stdout);
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		printf("child failed with status %x\n", status);
+}
+
+static void read_trace(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[128];
+	u64 alloc = 0;
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		struct trace_op op = {};
+		char c;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%c %u %u", &c, &op.id, &op.size) < 2 ||
+				(c != 'a' && c != 'f') || (c == 'a' && !op.size)) {
+			fprintf(stderr, "%s: bad line: %s", path, line);
+			exit(1);
+		}
+		if (c == 'f')
+			op.size = 0;
+		if (trace_len == alloc) {
+			alloc = alloc ? 2*alloc : 1024;
+			trace = realloc(trace, alloc * sizeof(*trace));
+		}
+		trace[trace_len++] = op;
+		if (op.id >= trace_ids)
+			trace_ids = op.id + 1;
+	}
+	fclose(f);
+}
+
+/* comma-separated numbers with optional k/M/G suffix */
+static int parse_list(char *s, u64 *list, int max)
+{
+	int n = 0;
+
+	for (char *tok = strtok(s, ","); tok && n < max; tok = strtok(NULL, ",")) {
+		char *end;
+		u64 val = strtoull(tok, &end, 0);
+		switch (*end) {
+		case 'G': val <<= 10; /* fall through */
+		case 'M': val <<= 10; /* fall through */
+		case 'k': val <<= 10;
+		}
+		list[n++] = val;
+	}
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	u64 intervals[8] = { 1<<16, 1<<12, 1<<8 };
+	u64 limits[8] = { 64<<20, 1<<30 };
+	int nr_intervals = 3, nr_limits = 2;
+	const char *sizes = "mixed", *lifetime = "short", *trace_path = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:n:s:l:r:i:m:")) != -1) {
+		switch (c) {
+		case 't': nr_threads = atoll(optarg); break;
+		case 'n': nr_ops = atoll(optarg); break;
+		case 's': sizes = optarg; break;
+		case 'l': lifetime = optarg; break;
+		case 'r': trace_path = optarg; break;
+		case 'i': nr_intervals = parse_list(optarg, intervals, ARRAY_SIZE(intervals)); break;
+		case 'm': nr_limits = parse_list(optarg, limits, ARRAY_SIZE(limits)); break;
+		default:
+			fprintf(stderr, "usage: %s [-t threads] [-n ops] [-s small|mixed|large] [-l short|long] [-r trace] [-i intervals] [-m limits]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!strcmp(sizes, "small")) {
+		size_lo = 3; size_hi = 9;
+	} else if (!strcmp(sizes, "mixed")) {
+		size_lo = 3; size_hi = 20;
+	} else if (!strcmp(sizes, "large")) {
+		size_lo = 16; size_hi = 26;
+	} else {
+		fprintf(stderr, "unknown size distribution %s\n", sizes);
+		return 1;
+	}
+	if (!strcmp(lifetime, "short")) {
+		mean_lifetime = 32;
+	} else if (!strcmp(lifetime, "long")) {
+		mean_lifetime = 4096;
+	} else {
+		fprintf(stderr, "unknown lifetime %s\n", lifetime);
+		return 1;
+	}
+	if (trace_path)
+		read_trace(trace_path);
+
+	tsc_per_64k_cycles = loop16();
+	if (trace_path)
+		printf("%lld threads replaying %s, %lld ops each\n", nr_threads, trace_path, trace_len);
+	else
+		printf("%lld threads, %lld ops each, %s sizes, %s lifetimes\n", nr_threads, nr_ops, sizes, lifetime);
+	printf("%-24s %8s %7s %7s %7s %9s %8s %9s %8s %8s %8s %8s %8s %8s\n",
+			"config", "Mops/s", "p50", "p99", "p99.9", "max", "rss_MiB", "minflt",
+			"mmap", "munmap", "mprotect", "madvise", "other", "objects");
+	run_child(0, 0);
+	for (int l=0; l<nr_limits; l++)
+		for (int i=0; i<nr_intervals; i++)
+			run_child(intervals[i], limits[l]);
+	printf("- not measured, the base allocator's syscalls happen inside libc\n");
+	return 0;
+}
@@ -0,0 +1,323 @@
+/*
+ * ufence_preload - run any binary with ufence, no allocator changes needed
+ *
+ *	gcc -O2 -fno-omit-frame-pointer -shared -fPIC ufence_preload.c -o ufence.so -ldl
+ *	LD_PRELOAD=./ufence.so ./your_program
+ *
+ * Wraps malloc and friends of whatever allocator comes next in the symbol
+ * lookup order, glibc or jemalloc alike.  Sampled allocations go to ufence,
+ * everything else goes straight through.  On free() a single htable probe
+ * tells ufence objects apart from regular ones, so no object headers are
+ * needed and buffer underruns hit a guard page as they should.  Freeing a
+ * ufence object twice gets reported, as long as the first free is still in
+ * quarantine.  After that the real allocator sees the pointer and usually
+ * aborts with a message of its own.
+ *
+ * Unsampled allocations pay the sampling countdown and frees pay one hash and
+ * two cachelines.  Compared to the allocator itself, that is in the noise.
+ *
+ * We also install a SIGSEGV/SIGBUS handler once ufence is initialized.
+ * Faults in ufence memory get reported and fixed up, anything else,
+ * including signals sent with kill(), goes to whatever handler the program
+ * installed.  Programs installing their own handler through sigaction() or
+ * signal() are chained behind ours instead of replacing it.
+ *
+ * Environment:
+ * UFENCE_MEM_LIMIT		- memory limit in bytes, 0 disables ufence
+ * UFENCE_SAMPLE_INTERVAL	- average number of allocations between samples
+ * UFENCE_POOL			- 1 to allocate from a pre-reserved region pool
+ * UFENCE_CONFIG		- file to reread mem_limit/sample_interval from
+ * UFENCE_STATS			- file to write counters to, once per second
+ */
+#define UFENCE_LIBRARY
+#include "ufence.c"
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+
+#ifndef RTLD_NEXT	/* only defined with _GNU_SOURCE, which clashes with gettid() */
+#define RTLD_NEXT	((void *) -1l)
+#endif
+
+#define DEFAULT_MEM_LIMIT	(1ull<<26)	/* 64MiB */
+/*
+ * malloc() has to return 16-byte aligned memory and ufence would happily
+ * return odd addresses to catch single-byte overflows.  Round up and accept
+ * that overflows by less than 16 bytes go unnoticed, same as kfence.
+ */
+#define MALLOC_ALIGN		16
+
+static void *(*real_malloc)(size_t size);
+static void *(*real_calloc)(size_t nmemb, size_t size);
+static void *(*real_realloc)(void *p, size_t size);
+static void (*real_free)(void *p);
+static void *(*real_memalign)(size_t alignment, size_t size);
+static int (*real_posix_memalign)(void **p, size_t alignment, size_t size);
+static size_t (*real_malloc_usable_size)(void *p);
+static int (*real_sigaction)(int sig, const struct sigaction *act, struct sigaction *old);
+
+/*
+ * dlsym() may call calloc() before we know the real calloc.  Hand out memory
+ * from a small static buffer while resolving and never free it.
+ */
+static char bootstrap_buf[4096] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+static __thread int resolving;
+
+static void *bootstrap_alloc(size_t size)
+{
+	size = ALIGN_UP(size, 16);
+	size_t used = __sync_fetch_and_add(&bootstrap_used, size);
+	assert(used + size <= sizeof(bootstrap_buf));
+	return bootstrap_buf + used;
+}
+
+static int is_bootstrap(void *p)
+{
+	return (char *)p >= bootstrap_buf && (char *)p < bootstrap_buf + sizeof(bootstrap_buf);
+}
+
+static void resolve(void)
+{
+	resolving = 1;
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	real_memalign = dlsym(RTLD_NEXT, "memalign");
+	real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+	real_malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+	real_sigaction = dlsym(RTLD_NEXT, "sigaction");
+	resolving = 0;
+}
+
+/*
+ * Handlers the program installed for SIGSEGV and SIGBUS.  We keep ours
+ * installed and call theirs for faults that aren't ours.
+ */
+static struct sigaction app_action[2];
+static int handler_installed;
+
+static struct sigaction *app_sigaction(int sig)
+{
+	if (!handler_installed || (sig != SIGSEGV && sig != SIGBUS))
+		return NULL;
+	return &app_action[sig == SIGBUS];
+}
+
+/*
+ * Signals sent with kill() and friends have si_code <= 0 and si_pid where
+ * si_addr would be, those go straight to the program.  A real fault ignored
+ * by the program would just fault again, so it gets the default as well.
+ */
+static void ufence_signal_handler(int sig, siginfo_t *info, void *uc)
+{
+	int sent = info->si_code <= 0;
+
+	if (!sent && ufence_segfault(info->si_addr, uc))
+		return; /* ufence handled the segfault */
+	struct sigaction *act = app_sigaction(sig);
+	if (act->sa_flags & SA_SIGINFO) {
+		act->sa_sigaction(sig, info, uc);
+	} else if (act->sa_handler == SIG_IGN && sent) {
+		return;
+	} else if (act->sa_handler == SIG_DFL || act->sa_handler == SIG_IGN) {
+		/* delivered once we return */
+		struct sigaction dfl = { .sa_handler = SIG_DFL };
+		real_sigaction(sig, &dfl, NULL);
+		raise(sig);
+	} else {
+		act->sa_handler(sig);
+	}
+}
+
+static void install_handler(void)
+{
+	struct sigaction act = {};
+
+	sigemptyset(&act.sa_mask);
+	sigaddset(&act.sa_mask, SIGBUS);
+	sigaddset(&act.sa_mask, SIGSEGV);
+	act.sa_flags = SA_SIGINFO|SA_NODEFER|SA_ONSTACK;
+	act.sa_sigaction = ufence_signal_handler;
+	real_sigaction(SIGSEGV, &act, &app_action[0]);
+	real_sigaction(SIGBUS, &act, &app_action[1]);
+	handler_installed = 1;
+}
+
+static u64 env_u64(const char *name, u64 def)
+{
+	const char *s = getenv(name);
+	return s && *s ? strtoull(s, NULL, 0) : def;
+}
+
+__attribute__((constructor))
+static void ufence_preload_init(void)
+{
+	if (!real_malloc)
+		resolve();
+	u64 mem_limit = env_u64("UFENCE_MEM_LIMIT", DEFAULT_MEM_LIMIT);
+	if (!mem_limit)
+		return;
+	ufence_set_sample_interval(env_u64("UFENCE_SAMPLE_INTERVAL", DEFAULT_SAMPLE_INTERVAL));
+	if (env_u64("UFENCE_POOL", 0))
+		ufence_init_pool(mem_limit);
+	else
+		ufence_init(mem_limit);
+	/* not before, ufence_segfault() needs ufence_hmap */
+	install_handler();
+	const char *path = getenv("UFENCE_CONFIG");
+	if (path && *path)
+		ufence_set_config_file(path);
+	path = getenv("UFENCE_STATS");
+	if (path && *path)
+		ufence_set_stats_file(path);
+}
+
+void *malloc(size_t size)
+{
+	if (unlikely(!real_malloc)) {
+		if (resolving)
+			return bootstrap_alloc(size);
+		resolve();
+	}
+	if (ufence_hmap) {
+		void *p = ufence_malloc(ALIGN_UP(size, MALLOC_ALIGN));
+		if (p)
+			return p;
+	}
+	return real_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (unlikely(!real_calloc)) {
+		if (resolving)
+			return bootstrap_alloc(total); /* static buffer is zeroed */
+		resolve();
+	}
+	if (ufence_hmap) {
+		/* fresh anonymous mapping, already zeroed */
+		void *p = ufence_malloc(ALIGN_UP(total, MALLOC_ALIGN));
+		if (p)
+			return p;
+	}
+	return real_calloc(nmemb, size);
+}
+
+void free(void *p)
+{
+	if (unlikely(!p || is_bootstrap(p)))
+		return;
+	if (ufence_find(p)) {
+		ufence_free(p);
+		return;
+	}
+	/* reported, don't let the real allocator crash on it */
+	if (unlikely(ufence_double_free(p)))
+		return;
+	real_free(p);
+}
+
+void *realloc(void *p, size_t size)
+{
+	if (unlikely(!real_realloc))
+		resolve();
+	if (!p)
+		return malloc(size);
+	struct mapping *m = ufence_find(p);
+	if (m || is_bootstrap(p)) {
+		size_t old_size = m ? m->size : bootstrap_buf + sizeof(bootstrap_buf) - (char *)p;
+		void *new = malloc(size);
+		if (!new)
+			return NULL;
+		memcpy(new, p, old_size < size ? old_size : size);
+		free(p);
+		return new;
+	}
+	return real_realloc(p, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	if (unlikely(!real_memalign))
+		resolve();
+	if (ufence_hmap) {
+		void *p = ufence_memalign(alignment, size);
+		if (p)
+			return p;
+	}
+	return real_memalign(alignment, size);
+}
+
+int posix_memalign(void **pp, size_t alignment, size_t size)
+{
+	if (unlikely(!real_posix_memalign))
+		resolve();
+	if (alignment < sizeof(void *) || alignment & (alignment-1))
+		return EINVAL;
+	if (ufence_hmap) {
+		void *p = ufence_memalign(alignment, size);
+		if (p) {
+			*pp = p;
+			return 0;
+		}
+	}
+	return real_posix_memalign(pp, alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+	return memalign(PAGE_SIZE, size);
+}
+
+void *pvalloc(size_t size)
+{
+	return memalign(PAGE_SIZE, ALIGN_UP(size, PAGE_SIZE));
+}
+
+size_t malloc_usable_size(void *p)
+{
+	if (unlikely(!real_malloc_usable_size))
+		resolve();
+	struct mapping *m = ufence_find(p);
+	if (m)
+		return m->size;
+	return p ? real_malloc_usable_size(p) : 0;
+}
+
+int sigaction(int sig, const struct sigaction *act, struct sigaction *old)
+{
+	if (unlikely(!real_sigaction))
+		resolve();
+	struct sigaction *app = app_sigaction(sig);
+	if (!app)
+		return real_sigaction(sig, act, old);
+	if (old)
+		*old = *app;
+	if (act)
+		*app = *act;
+	return 0;
+}
+
+void (*signal(int sig, void (*handler)(int)))(int)
+{
+	struct sigaction act = { .sa_handler = handler, .sa_flags = SA_RESTART };
+	struct sigaction old;
+
+	sigemptyset(&act.sa_mask);
+	if (sigaction(sig, &act, &old))
+		return SIG_ERR;
+	return old.sa_handler;
+}